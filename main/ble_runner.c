@@ -13,9 +13,13 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/timers.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #include "ble_runner.h"
 #include "data.h"
+#include "sampling.h"
+#include "resample.h"
+#include "ingest.h"
 
 #define TAG "ble_runner"
 
@@ -33,22 +37,394 @@ uint16_t gattc_conn_id;
 esp_bd_addr_t gattc_remote_bda;
 esp_ble_addr_type_t gattc_ble_addr_type;
 
-typedef struct _srv_profile {
-	struct _srv_profile *next;
+/*
+ * Services and characteristics of the connected peripheral live in
+ * static tables, rebuilt on every connect without touching the heap.
+ * Characteristics are looked up by handle on every notification, so
+ * they are kept in an open addressed hash table, with linear probing.
+ * Handle 0 is not valid in GATT, and marks an empty slot.
+ */
+#define MAX_SRVPROFS 8
+#define MAX_HANDLES 16
+#define HTABSIZE 32  // power of 2, at least twice MAX_HANDLES
+#define MAX_ELEMS 32  // characteristics of a service, descriptors
+
+typedef struct {
 	const service_t *srvdesc;
 	uint16_t start_handle;
 	uint16_t end_handle;
 } srv_profile_t;
-static srv_profile_t *srvprofs = NULL;
+static srv_profile_t srvprofs[MAX_SRVPROFS];
+static int nsrvprofs = 0;
 
-typedef struct _handle {
-	struct _handle *next;
+typedef struct {
 	uint16_t handle;
+	uint16_t cccd;  // client config descriptor, 0 until found
 	bool is_notify;
+	bool write_nr;  // can be written without response
+	uint8_t srv;  // index in srvlist of the periph
+	uint8_t chr;  // index in chars of the service
 	void (*callback)(uint8_t *data, size_t datalen);
-	srv_profile_t *sp;
+	srv_profile_t *sp;  // service it was found in
 } handle_t;
-static handle_t *handles = NULL;
+static handle_t htab[HTABSIZE];
+static int nhandles = 0;
+
+static esp_gattc_char_elem_t char_elems[MAX_ELEMS];
+static esp_gattc_descr_elem_t descr_elems[MAX_ELEMS];
+
+static handle_t *handle_find(uint16_t hdl)
+{
+	for (unsigned i = hdl % HTABSIZE; htab[i].handle;
+			i = (i + 1) % HTABSIZE) {
+		if (htab[i].handle == hdl) return &htab[i];
+	}
+	return NULL;
+}
+
+static handle_t *handle_add(uint16_t hdl)
+{
+	unsigned i;
+
+	if (nhandles >= MAX_HANDLES) return NULL;
+	for (i = hdl % HTABSIZE; htab[i].handle; i = (i + 1) % HTABSIZE) {
+		if (htab[i].handle == hdl) return &htab[i];
+	}
+	nhandles++;
+	htab[i].handle = hdl;
+	return &htab[i];
+}
+
+static void handles_clear(void)
+{
+	memset(htab, 0, sizeof(htab));
+	nhandles = 0;
+	nsrvprofs = 0;
+}
+
+/*
+ * The last device that was subscribed to is remembered in NVS. On start
+ * it is connected to directly, without a scan, and a failed direct
+ * connect falls back to the scan. Its database is kept by the stack in
+ * its own NVS cache (CONFIG_BT_GATTC_CACHE_NVS_FLASH), so that the
+ * discovery over the air is skipped as well. A rejected subscription
+ * on a database from the cache drops the cache entry and reconnects.
+ */
+#define NVS_NAMESPACE "ble_runner"
+#define NVS_LASTDEV "lastdev"
+#define LASTDEV_VERSION 2
+
+typedef struct {
+	uint8_t version;
+	uint8_t periph;  // index in the periph array
+	uint16_t uuid;  // of the periph, in case the array changed
+	esp_bd_addr_t bda;
+	uint8_t addr_type;
+} lastdev_t;
+static lastdev_t lastdev;
+static bool lastdev_valid = false;
+
+/*
+ * Negotiated link parameters, and arrival of notifications over a
+ * LINK_PERIOD window. Jitter is the smoothed difference of successive
+ * inter-arrival times, as in RFC 3550, kept times 16.
+ */
+#define LINK_PERIOD 10000000LL  // us
+
+static struct {
+	uint16_t interval;  // 1.25 ms units
+	uint16_t latency;
+	uint16_t timeout;  // 10 ms units
+	uint16_t tx_octets;
+	uint8_t tx_phy, rx_phy;
+} conn;
+
+static struct {
+	int64_t start;  // of the window
+	int64_t last;  // previous notification
+	uint32_t count;
+	uint32_t bytes;
+	uint32_t ia;  // previous inter-arrival time, us
+	uint32_t max_ia;
+	uint32_t jitter16;
+} arrival;
+
+static void link_report(int64_t now)
+{
+	uint32_t secs = (now - arrival.start) / 1000000;
+
+	if (!secs) secs = 1;
+	ESP_LOGI(TAG, "Link: %lu notifications %lu B per s, max gap %lu ms, "
+			"jitter %lu us; interval %u.%02u ms, latency %u, "
+			"timeout %u ms, tx %u octets, PHY %u/%u",
+			arrival.count / secs, arrival.bytes / secs,
+			arrival.max_ia / 1000, arrival.jitter16 / 16,
+			conn.interval * 5 / 4, conn.interval * 125 % 100,
+			conn.latency, conn.timeout * 10, conn.tx_octets,
+			conn.tx_phy, conn.rx_phy);
+	arrival.start = now;
+	arrival.count = arrival.bytes = arrival.max_ia = 0;
+}
+
+static void link_arrival(size_t len)
+{
+	int64_t now = esp_timer_get_time();
+
+	if (!arrival.start) {
+		arrival.start = now;
+	} else {
+		uint32_t ia = now - arrival.last;
+		if (arrival.ia) {
+			uint32_t d = (ia > arrival.ia) ? ia - arrival.ia
+						: arrival.ia - ia;
+			arrival.jitter16 += d - arrival.jitter16 / 16;
+		}
+		arrival.ia = ia;
+		if (ia > arrival.max_ia) arrival.max_ia = ia;
+	}
+	arrival.last = now;
+	arrival.count++;
+	arrival.bytes += len;
+	if (now - arrival.start >= LINK_PERIOD) link_report(now);
+}
+
+// Ask for the periph's link profile, the stack reports what it got
+static void link_request(void)
+{
+	const link_t *lp = pp->link;
+
+	if (!lp) return;
+	ESP_LOGI(TAG, "Requesting interval %u-%u, latency %u, timeout %u",
+			lp->min_int, lp->max_int, lp->latency, lp->timeout);
+	esp_ble_conn_update_params_t params = {
+		.min_int = lp->min_int,
+		.max_int = lp->max_int,
+		.latency = lp->latency,
+		.timeout = lp->timeout,
+	};
+	memcpy(params.bda, gattc_remote_bda, sizeof(esp_bd_addr_t));
+	if (esp_ble_gap_update_conn_params(&params) != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to request connection parameters");
+	}
+}
+
+/*
+ * Outbound writes go through a short queue, so that callers on any
+ * task (timers, ingestion) do not block and do not collide. Only one
+ * write is in flight at a time, the next one is issued when the stack
+ * reports completion with WRITE_CHAR_EVT. Writes without response are
+ * used where the characteristic allows them, they complete as soon as
+ * the stack has sent them. A write that is the same as one already
+ * waiting (a periodic heartbeat) is merged with it. A write whose
+ * completion does not come within WQ_TIMEOUT_MS is retired as failed.
+ *
+ * The writable handles are copied under the lock when the periph gets
+ * them, so that callers do not look into the handle table, which the
+ * stack task rebuilds on every connect.
+ */
+#define WQSIZE 8
+#define WMAX 64
+#define WQ_TIMEOUT_MS 2000
+#define MAX_WHANDLES 4
+
+typedef struct {
+	uint16_t handle;
+	bool write_nr;
+	uint8_t len;
+	uint8_t data[WMAX];
+} wcmd_t;
+
+static wcmd_t wq[WQSIZE];
+static int wq_head, wq_len;
+static bool wq_inflight;
+static portMUX_TYPE wq_lock = portMUX_INITIALIZER_UNLOCKED;
+static TimerHandle_t write_timer;
+
+static struct {
+	uint16_t handle;
+	bool write_nr;
+} whandles[MAX_WHANDLES];
+static int nwhandles;
+
+static struct {
+	uint32_t sent;
+	uint32_t merged;
+	uint32_t refused;  // queue full or not connected
+	uint32_t failed;
+	int high;
+} wstats;
+
+// Issue the head of the queue, unless a write is in flight
+static void wq_kick(void)
+{
+	wcmd_t cmd;
+
+	for (;;) {
+		taskENTER_CRITICAL(&wq_lock);
+		if (wq_inflight || !wq_len) {
+			taskEXIT_CRITICAL(&wq_lock);
+			return;
+		}
+		cmd = wq[wq_head];
+		wq_head = (wq_head + 1) % WQSIZE;
+		wq_len--;
+		wq_inflight = true;
+		wstats.sent++;
+		taskEXIT_CRITICAL(&wq_lock);
+
+		ESP_LOGD(TAG, "write handle 0x%04hx%s", cmd.handle,
+				cmd.write_nr ? " without response" : "");
+		ESP_LOG_BUFFER_HEX_LEVEL(TAG, cmd.data, cmd.len, ESP_LOG_DEBUG);
+		esp_err_t err = esp_ble_gattc_write_char(
+				saved_gattc_if,
+				gattc_conn_id,
+				cmd.handle,
+				cmd.len,
+				cmd.data,
+				cmd.write_nr ? ESP_GATT_WRITE_TYPE_NO_RSP
+					: ESP_GATT_WRITE_TYPE_RSP,
+				ESP_GATT_AUTH_REQ_NONE);
+		if (err == ESP_OK) {
+			xTimerReset(write_timer, 0);
+			return;
+		}
+		ESP_LOGE(TAG, "write_char error %d, dropping the write", err);
+		taskENTER_CRITICAL(&wq_lock);
+		wq_inflight = false;
+		wstats.failed++;
+		taskEXIT_CRITICAL(&wq_lock);
+	}
+}
+
+static void wq_done(bool ok)
+{
+	xTimerStop(write_timer, 0);
+	taskENTER_CRITICAL(&wq_lock);
+	if (!wq_inflight) {  // retired by the timeout already
+		taskEXIT_CRITICAL(&wq_lock);
+		return;
+	}
+	wq_inflight = false;
+	if (!ok) wstats.failed++;
+	taskEXIT_CRITICAL(&wq_lock);
+	wq_kick();
+}
+
+static void writeTimeoutCallback(TimerHandle_t xTimer)
+{
+	ESP_LOGE(TAG, "Write not completed in %d ms, retiring it",
+			WQ_TIMEOUT_MS);
+	wq_done(false);
+}
+
+// Let the periph write to a handle
+static void wq_allow(uint16_t handle, bool write_nr)
+{
+	taskENTER_CRITICAL(&wq_lock);
+	if (nwhandles < MAX_WHANDLES) {
+		whandles[nwhandles].handle = handle;
+		whandles[nwhandles].write_nr = write_nr;
+		nwhandles++;
+	}
+	taskEXIT_CRITICAL(&wq_lock);
+}
+
+static void wq_reset(void)
+{
+	xTimerStop(write_timer, 0);
+	taskENTER_CRITICAL(&wq_lock);
+	wq_head = wq_len = 0;
+	wq_inflight = false;
+	nwhandles = 0;
+	taskEXIT_CRITICAL(&wq_lock);
+	if (wstats.sent || wstats.refused || wstats.failed) {
+		ESP_LOGI(TAG, "Writes %lu, merged %lu, refused %lu, "
+				"failed %lu, queue high water %d of %d",
+				wstats.sent, wstats.merged, wstats.refused,
+				wstats.failed, wstats.high, WQSIZE);
+	}
+	memset(&wstats, 0, sizeof(wstats));
+}
+
+static bool direct;  // connecting to lastdev without a scan
+static bool cached;  // database of this connection is from the cache
+static bool saved;  // lastdev is up to date with this connection
+static int unsubscribed;  // notify handles without an acknowledged CCCD
+static bool rescan;  // restart the search after our own disconnect
+static bool got_data;  // since the start of the search
+static int64_t time_start;  // of the search, for time to first sample
+
+/*
+ * When the link to a device that was set up drops, it is first
+ * reconnected directly, for up to CONFIG_TINYECG_RECONNECT_MS. The
+ * periph is not stopped and the state stays receiving meanwhile, so
+ * the display keeps sweeping and shows the outage as a gap. Attempts
+ * end with the stack's connection timeout, and the next one follows
+ * after an exponential backoff.
+ */
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 4000
+
+static TimerHandle_t reconnect_timer;
+static bool reconnecting = false;
+static int64_t reconnect_since;
+static uint32_t backoff_ms;
+
+static void lastdev_load(void)
+{
+	nvs_handle_t nvs;
+	size_t len = sizeof(lastdev);
+	int np = 0;
+
+	lastdev_valid = false;
+	if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return;
+	esp_err_t err = nvs_get_blob(nvs, NVS_LASTDEV, &lastdev, &len);
+	nvs_close(nvs);
+	if (err != ESP_OK || len != sizeof(lastdev)
+			|| lastdev.version != LASTDEV_VERSION) {
+		return;
+	}
+	while (pparr[np]) np++;
+	if (lastdev.periph >= np || pparr[lastdev.periph]->uuid != lastdev.uuid)
+		return;
+	ESP_LOGI(TAG, "Last device was %s", pparr[lastdev.periph]->name
+			? pparr[lastdev.periph]->name : "noname");
+	lastdev_valid = true;
+}
+
+// Store the current connection, once all notify handles are subscribed.
+// It is called on the stack task, but at most once per connection, and
+// only writes the flash when the device changed.
+static void lastdev_save(void)
+{
+	nvs_handle_t nvs;
+	lastdev_t ld;
+	int np;
+
+	memset(&ld, 0, sizeof(ld));
+	for (np = 0; pparr[np] && pparr[np] != pp; np++);
+	if (!pparr[np]) return;
+	ld.version = LASTDEV_VERSION;
+	ld.periph = np;
+	ld.uuid = pp->uuid;
+	memcpy(ld.bda, gattc_remote_bda, sizeof(esp_bd_addr_t));
+	ld.addr_type = gattc_ble_addr_type;
+	saved = true;
+	if (lastdev_valid && !memcmp(&ld, &lastdev, sizeof(ld))) return;
+	if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+		ESP_LOGE(TAG, "Cannot open NVS to save the device");
+		return;
+	}
+	if (nvs_set_blob(nvs, NVS_LASTDEV, &ld, sizeof(ld)) == ESP_OK
+			&& nvs_commit(nvs) == ESP_OK) {
+		ESP_LOGI(TAG, "Saved the device for fast reconnect");
+		lastdev = ld;
+		lastdev_valid = true;
+	} else {
+		ESP_LOGE(TAG, "Failed to save the device");
+	}
+	nvs_close(nvs);
+}
 
 void ble_stop()
 {
@@ -56,6 +432,11 @@ void ble_stop()
 	xSemaphoreGive(btSemaphore);
 }
 
+static void timers_stopped(void *stopped, uint32_t unused)
+{
+	xSemaphoreGive(stopped);
+}
+
 static TimerHandle_t read_rssi_timer;
 static void readRssiCallback(TimerHandle_t xTimer)
 {
@@ -74,6 +455,25 @@ static void initiateConnectCallback(TimerHandle_t xTimer)
 			gattc_ble_addr_type, true);
 }
 
+static bool reconnect_open(void)
+{
+	ESP_LOGI(TAG, "Reconnect attempt");
+	if (esp_ble_gattc_open(saved_gattc_if, gattc_remote_bda,
+			gattc_ble_addr_type, true) != ESP_OK) {
+		ESP_LOGE(TAG, "Reconnect attempt not started");
+		return false;
+	}
+	return true;
+}
+
+// Only issues the attempt, its failure is handled on the stack's task
+// when OPEN_EVT reports it. An attempt that the stack did not take
+// leaves no event, it is tried again after the same backoff.
+static void reconnectCallback(TimerHandle_t xTimer)
+{
+	if (!reconnect_open()) xTimerStart(reconnect_timer, 0);
+}
+
 static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
 	uint8_t *adv_name = NULL;
@@ -207,14 +607,37 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
 				param->update_conn_params.conn_int,
 				param->update_conn_params.latency,
 				param->update_conn_params.timeout);
+		if (param->update_conn_params.status == ESP_BT_STATUS_SUCCESS) {
+			conn.interval = param->update_conn_params.conn_int;
+			conn.latency = param->update_conn_params.latency;
+			conn.timeout = param->update_conn_params.timeout;
+		}
 		break;
 	case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
-		ESP_LOGD(TAG, "packet length updated: rx = %d, "
+		ESP_LOGI(TAG, "packet length updated: rx = %d, "
 				"tx = %d, status = %d",
 				param->pkt_data_length_cmpl.params.rx_len,
 				param->pkt_data_length_cmpl.params.tx_len,
 				param->pkt_data_length_cmpl.status);
+		if (param->pkt_data_length_cmpl.status == ESP_BT_STATUS_SUCCESS)
+			conn.tx_octets = param->pkt_data_length_cmpl.params.tx_len;
+		break;
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+	case ESP_GAP_BLE_SET_PREFERRED_PHY_COMPLETE_EVT:
+		ESP_LOGD(TAG, "set preferred PHY status %d",
+				param->set_perf_phy.status);
 		break;
+	case ESP_GAP_BLE_PHY_UPDATE_COMPLETE_EVT:
+		ESP_LOGI(TAG, "PHY updated: tx %d, rx %d, status %d",
+				param->phy_update.tx_phy,
+				param->phy_update.rx_phy,
+				param->phy_update.status);
+		if (param->phy_update.status == ESP_BT_STATUS_SUCCESS) {
+			conn.tx_phy = param->phy_update.tx_phy;
+			conn.rx_phy = param->phy_update.rx_phy;
+		}
+		break;
+#endif
 	case ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT:
 		ESP_LOGD(TAG, "rssi read: %d status %d",
 				param->read_rssi_cmpl.rssi,
@@ -234,10 +657,9 @@ static void esp_gap_cb(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
 	}
 }
 
-static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
-		esp_ble_gattc_cb_param_t *p_data)
+// Connect to the last device directly if known, otherwise scan
+static void start_search(bool try_direct)
 {
-	handle_t *handle;  // used in a couple of case sections
 	static esp_ble_scan_params_t scan_params = {
 		.scan_type = BLE_SCAN_TYPE_PASSIVE,
 		.own_addr_type = BLE_ADDR_TYPE_PUBLIC,
@@ -246,6 +668,156 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 		.scan_window = 0x30,
 		.scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE,
 	};
+
+	time_start = esp_timer_get_time();
+	cached = saved = rescan = got_data = false;
+	direct = try_direct && lastdev_valid;
+	if (!direct) {
+		// This will send GAP indication that it can start scanning
+		ESP_ERROR_CHECK(esp_ble_gap_set_scan_params(&scan_params));
+		return;
+	}
+	pp = pparr[lastdev.periph];
+	ESP_LOGI(TAG, "Connecting directly to the last device");
+	ESP_LOG_BUFFER_HEX_LEVEL(TAG, lastdev.bda, sizeof(esp_bd_addr_t),
+			ESP_LOG_INFO);
+	report_state(state_scanning);
+	if (pp->name) report_periph(pp->name, strlen(pp->name));
+	report_found(true);
+	memcpy(&gattc_remote_bda, lastdev.bda, sizeof(esp_bd_addr_t));
+	gattc_ble_addr_type = lastdev.addr_type;
+	if (esp_ble_gattc_open(saved_gattc_if, gattc_remote_bda,
+			gattc_ble_addr_type, true) != ESP_OK) {
+		ESP_LOGE(TAG, "Direct connect failed, scanning");
+		pp = NULL;
+		report_found(false);
+		direct = false;
+		ESP_ERROR_CHECK(esp_ble_gap_set_scan_params(&scan_params));
+	}
+}
+
+static void reconnect_begin(void)
+{
+	ESP_LOGI(TAG, "Link lost, reconnecting for up to %d ms",
+			CONFIG_TINYECG_RECONNECT_MS);
+	reconnecting = true;
+	reconnect_since = esp_timer_get_time();
+	backoff_ms = RECONNECT_MIN_MS;
+	ingest_call(pp->pause);
+	if (!reconnect_open()) reconnect_failed();
+}
+
+// An attempt timed out or failed, retry or give up on the device
+static void reconnect_failed(void)
+{
+	int64_t elapsed = (esp_timer_get_time() - reconnect_since) / 1000;
+
+	if (elapsed + backoff_ms > CONFIG_TINYECG_RECONNECT_MS) {
+		ESP_LOGI(TAG, "No reconnect in %lld ms, scanning", elapsed);
+		reconnecting = false;
+		if (pp) ingest_call(pp->stop);
+		pp = NULL;
+		report_found(false);
+		start_search(false);
+		return;
+	}
+	ESP_LOGI(TAG, "Retry in %lu ms", backoff_ms);
+	xTimerChangePeriod(reconnect_timer, pdMS_TO_TICKS(backoff_ms), 0);
+	xTimerStart(reconnect_timer, 0);
+	backoff_ms *= 2;
+	if (backoff_ms > RECONNECT_MAX_MS) backoff_ms = RECONNECT_MAX_MS;
+}
+
+static uint16_t find_cccd(esp_gatt_if_t gattc_if, handle_t *handle)
+{
+	uint16_t count = 0;
+	uint16_t client_config_handle = 0;
+
+	if (esp_ble_gattc_get_attr_count(
+			gattc_if,
+			gattc_conn_id,
+			ESP_GATT_DB_DESCRIPTOR,
+			handle->sp->start_handle,
+			handle->sp->end_handle,
+			handle->handle,
+			&count) != ESP_GATT_OK) {
+		ESP_LOGE(TAG, "esp_ble_gattc_get_attr_count error");
+		return 0;
+	}
+	ESP_LOGI(TAG, "%hu descriptors found", count);
+	if (count == 0) {
+		ESP_LOGE(TAG, "zero descriptors found");
+		return 0;
+	}
+	if (count > MAX_ELEMS) count = MAX_ELEMS;
+	esp_gattc_descr_elem_t *descr_elem_result = descr_elems;
+	if (esp_ble_gattc_get_all_descr(
+			gattc_if,
+			gattc_conn_id,
+			handle->handle,
+			descr_elem_result,
+			&count,
+			0) != ESP_GATT_OK) {
+		ESP_LOGE(TAG, "get_all_descr error");
+		return 0;
+	}
+	for (int i = 0; i < count; i++) {
+		ESP_LOGI(TAG, "%d: %04x",
+				i,
+				descr_elem_result[i].uuid.uuid.uuid16
+			);
+		if (descr_elem_result[i].uuid.uuid.uuid16 ==
+				ESP_GATT_UUID_CHAR_CLIENT_CONFIG) {
+			client_config_handle =
+				descr_elem_result[i].handle;
+		}
+	}
+	return client_config_handle;
+}
+
+// On the ingestion task, after what the last connection left queued
+static void periph_start(uint8_t *data, size_t datalen)
+{
+	const periph_t *p;
+
+	memcpy(&p, data, sizeof(p));
+	resample_init(p->sps, SPS);
+	if (p->start) (p->start)();
+}
+
+// Handles are known, subscribe to notifications and start the periph
+static void subscribe(esp_gatt_if_t gattc_if)
+{
+	unsubscribed = 0;
+	for (handle_t *handle = htab; handle < htab + HTABSIZE; handle++) {
+		if (!handle->handle) continue;
+		if (handle->is_notify) {
+			ESP_LOGI(TAG, "Registering for notify");
+			unsubscribed++;
+			esp_ble_gattc_register_for_notify(
+				gattc_if,
+				gattc_remote_bda,
+				handle->handle);
+		} else {
+			ESP_LOGI(TAG, "Returning write hdl");
+			wq_allow(handle->handle, handle->write_nr);
+			// In order with start, on the ingestion task
+			ingest_control(handle->callback,
+				&handle->handle,
+				sizeof(uint16_t));
+		}
+	}
+	if (xTimerStart(read_rssi_timer, 0) != pdPASS) {
+		ESP_LOGE(TAG, "Failed to start read rssi timer");
+	}
+	link_request();
+	ingest_control(periph_start, &pp, sizeof(pp));
+}
+
+static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
+		esp_ble_gattc_cb_param_t *p_data)
+{
+	handle_t *handle;  // used in a couple of case sections
 	// If multiple profiles, we would select the one and call its callback
 	switch (event) {
 	case ESP_GATTC_REG_EVT:
@@ -263,12 +835,21 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 					p_data->reg.app_id, p_data->reg.status);
 			return;
 		}
-		// This will send GAP indication that it can start scanning
-		ESP_ERROR_CHECK(esp_ble_gap_set_scan_params(&scan_params));
+		start_search(true);
 		break;
 	case ESP_GATTC_CONNECT_EVT:
 		ESP_LOGD(TAG, "ESP_GATTC_CONNECT_EVT conn_id %d, if %d",
 				p_data->connect.conn_id, gattc_if);
+		if (!pp) {  // late completion of an abandoned attempt
+			ESP_LOGI(TAG, "Unexpected connection, closing");
+			esp_ble_gattc_close(gattc_if, p_data->connect.conn_id);
+			break;
+		}
+		if (reconnecting) {
+			ESP_LOGI(TAG, "Reconnected after %lld ms",
+				(esp_timer_get_time() - reconnect_since) / 1000);
+			reconnecting = false;
+		}
 		gattc_conn_id = p_data->connect.conn_id;
 		memcpy(&gattc_remote_bda, p_data->connect.remote_bda,
 				sizeof(esp_bd_addr_t));
@@ -277,12 +858,41 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 				sizeof(esp_bd_addr_t), ESP_LOG_INFO);
 		ESP_ERROR_CHECK(esp_ble_gattc_send_mtu_req(gattc_if,
 				p_data->connect.conn_id));
+		memset(&conn, 0, sizeof(conn));
+		memset(&arrival, 0, sizeof(arrival));
+		conn.interval = p_data->connect.conn_params.interval;
+		conn.latency = p_data->connect.conn_params.latency;
+		conn.timeout = p_data->connect.conn_params.timeout;
+		conn.tx_phy = conn.rx_phy = 1;  // 1M until updated
+		// Data length and PHY help discovery too, so ask right away
+		if (pp && pp->link && pp->link->tx_octets) {
+			esp_ble_gap_set_pkt_data_len(gattc_remote_bda,
+					pp->link->tx_octets);
+		}
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+		if (pp && pp->link && pp->link->phy_2m) {
+			esp_ble_gap_set_preferred_phy(gattc_remote_bda, 0,
+				ESP_BLE_GAP_PHY_1M_PREF_MASK
+					| ESP_BLE_GAP_PHY_2M_PREF_MASK,
+				ESP_BLE_GAP_PHY_1M_PREF_MASK
+					| ESP_BLE_GAP_PHY_2M_PREF_MASK,
+				ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+		}
+#endif
 		break;
 	case ESP_GATTC_OPEN_EVT:
 		if (p_data->open.status == ESP_GATT_OK) {
 			ESP_LOGD(TAG, "open success");
 		} else {
 			ESP_LOGE(TAG, "open failed, status %d", p_data->open.status);
+			if (reconnecting) {
+				reconnect_failed();
+			} else if (direct) {
+				ESP_LOGI(TAG, "Last device not there, scanning");
+				pp = NULL;
+				report_found(false);
+				start_search(false);
+			}
 		}
 		break;
 	case ESP_GATTC_DIS_SRVC_CMPL_EVT:
@@ -345,11 +955,11 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 			    		== srv->uuid) {
 				ESP_LOGI(TAG, "Service uuid %04x discoverd",
 						srv->uuid);
-				srv_profile_t *srvprof =
-					malloc(sizeof(srv_profile_t));
-				assert(srvprof != NULL);
-				srvprof->next = srvprofs;
-				srvprofs = srvprof;
+				if (nsrvprofs >= MAX_SRVPROFS) {
+					ESP_LOGE(TAG, "Too many services");
+					break;
+				}
+				srv_profile_t *srvprof = &srvprofs[nsrvprofs++];
 				srvprof->srvdesc = srv;
 				srvprof->start_handle =
 					p_data->search_res.start_handle;
@@ -370,10 +980,11 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 		} else if (p_data->search_cmpl.searched_service_source
 				== ESP_GATT_SERVICE_FROM_NVS_FLASH) {
 			ESP_LOGD(TAG, "Service information came from NVS");
+			cached = true;
 		} else {
 			ESP_LOGW(TAG, "Unknown service information source");
 		}
-		if (!srvprofs) {
+		if (!nsrvprofs) {
 			ESP_LOGI(TAG, "Search complete w/o success, close");
 			if (esp_ble_gattc_close(gattc_if,
 				p_data->search_cmpl.conn_id) != ESP_GATT_OK) {
@@ -381,7 +992,8 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 			}
 			break;
 		}
-		for (srv_profile_t *sp = srvprofs; sp; sp = sp->next) {
+		for (srv_profile_t *sp = srvprofs; sp < srvprofs + nsrvprofs;
+				sp++) {
 			uint16_t count = 0;
 			if (esp_ble_gattc_get_attr_count(
 					gattc_if,
@@ -397,11 +1009,9 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 			ESP_LOGI(TAG, "%hu characteristics found", count);
 
 			if (!count) continue;
+			if (count > MAX_ELEMS) count = MAX_ELEMS;
 
-			esp_gattc_char_elem_t *char_elem_res =
-				(esp_gattc_char_elem_t *)malloc(
-					sizeof(esp_gattc_char_elem_t) * count);
-			assert(char_elem_res != NULL);
+			esp_gattc_char_elem_t *char_elem_res = char_elems;
 			if (esp_ble_gattc_get_all_char(
 					gattc_if,
 					p_data->search_cmpl.conn_id,
@@ -411,7 +1021,6 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 					&count,
 					0) != ESP_GATT_OK) {
 				ESP_LOGE(TAG, "get_all_char error");
-				free(char_elem_res);
 				continue;
 			}
 			for (int i = 0; i < count; i++) {
@@ -438,53 +1047,38 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 					       	chr->uuid; chr++) {
 					if (char_elem_res[i].uuid.uuid.uuid16
                                        	        	== chr->uuid) {
-						handle_t *handle = malloc(
-							sizeof(handle_t));
-						assert(handle != NULL);
-						handle->next = handles;
-						handles = handle;
-						handle->handle =
+						handle_t *handle = handle_add(
 							char_elem_res[i]
-							.char_handle;
+							.char_handle);
+						if (!handle) {
+							ESP_LOGE(TAG,
+							"Too many handles");
+							break;
+						}
+						handle->cccd = 0;
 						handle->is_notify =
 							chr->type == NOTIFY;
+						handle->write_nr =
+							char_elem_res[i]
+							.properties
+							& ESP_GATT_CHAR_PROP_BIT_WRITE_NR;
+						handle->srv = sp->srvdesc
+							- pp->srvlist;
+						handle->chr = chr
+							- sp->srvdesc->chars;
 						handle->callback =
 							chr->callback;
 						handle->sp = sp;
 					}
 				}
 			}
-			free(char_elem_res);
 		}
-
-		for (handle_t *handle = handles; handle;
-					handle = handle->next) {
-			if (handle->is_notify) {
-				ESP_LOGI(TAG, "Registering for notify");
-				esp_ble_gattc_register_for_notify(
-					gattc_if,
-					gattc_remote_bda,
-					handle->handle);
-			} else {
-				ESP_LOGI(TAG, "Returning write hdl");
-				handle->callback(
-					(uint8_t*)&handle->handle,
-					sizeof(uint16_t));
-			}
-		}
-		if (xTimerStart(read_rssi_timer, 0) != pdPASS) {
-			ESP_LOGE(TAG, "Failed to start read rssi timer");
-		}
-		if (pp->start) (pp->start)();
+		subscribe(gattc_if);
 		break;
 	case ESP_GATTC_REG_FOR_NOTIFY_EVT:
 		ESP_LOGD(TAG, "ESP_GATTC_REG_FOR_NOTIFY_EVT");
-		uint16_t count = 0;
 		uint16_t notify_enable = 1;
-		for (handle = handles; handle; handle = handle->next) {
-			if (handle->handle == p_data->reg_for_notify.handle)
-				break;
-		}
+		handle = handle_find(p_data->reg_for_notify.handle);
 		if (!handle) {
 			ESP_LOGE(TAG, "Unexpected handle %04hx",
 					p_data->reg_for_notify.handle);
@@ -495,60 +1089,15 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 					p_data->reg_for_notify.handle);
 			break;
 		}
-		if (esp_ble_gattc_get_attr_count(
-				gattc_if,
-				gattc_conn_id,
-				ESP_GATT_DB_DESCRIPTOR,
-				handle->sp->start_handle,
-				handle->sp->end_handle,
-				handle->handle,
-				&count) != ESP_GATT_OK) {
-			ESP_LOGE(TAG, "esp_ble_gattc_get_attr_count error");
-			break;
-		}
-		ESP_LOGI(TAG, "%hu descriptors found", count);
-		if (count == 0) {
-			ESP_LOGE(TAG, "zero descriptors found");
-			break;
-		}
-		esp_gattc_descr_elem_t *descr_elem_result = malloc(
-				sizeof(esp_gattc_descr_elem_t) * count);
-		if (!descr_elem_result) {
-			ESP_LOGE(TAG, "no memory for descriptors");
-			break;
-		}
-		if (esp_ble_gattc_get_all_descr(
-				gattc_if,
-				gattc_conn_id,
-				handle->handle,
-				descr_elem_result,
-				&count,
-				0) != ESP_GATT_OK) {
-			ESP_LOGE(TAG, "get_all_descr error");
-			free(descr_elem_result);
-			break;
-		}
-		uint16_t client_config_handle = 0;  // real handle cannot be 0?
-		for (int i = 0; i < count; i++) {
-			ESP_LOGI(TAG, "%d: %04x",
-					i,
-					descr_elem_result[i].uuid.uuid.uuid16
-				);
-			if (descr_elem_result[i].uuid.uuid.uuid16 ==
-					ESP_GATT_UUID_CHAR_CLIENT_CONFIG) {
-				client_config_handle =
-					descr_elem_result[i].handle;
-			}
-		}
-		free(descr_elem_result);
-		if (!client_config_handle) {
+		if (!handle->cccd) handle->cccd = find_cccd(gattc_if, handle);
+		if (!handle->cccd) {
 			ESP_LOGE(TAG, "did not find clinet config descriptor");
 			break;
 		}
 		if (esp_ble_gattc_write_char_descr(
 				gattc_if,
 				gattc_conn_id,
-				client_config_handle,
+				handle->cccd,
 				sizeof(notify_enable),
 				(uint8_t*)&notify_enable,
 				ESP_GATT_WRITE_TYPE_RSP,
@@ -564,10 +1113,7 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 			(p_data->notify.is_notify) ? "notify" : "indicate",
 			p_data->notify.value_len,
 			p_data->notify.handle);
-		for (handle = handles; handle; handle = handle->next) {
-			if (handle->handle == p_data->notify.handle)
-				break;
-		}
+		handle = handle_find(p_data->notify.handle);
 		if (!handle) {
 			ESP_LOGE(TAG, "Unexpected handle %04hx",
 					p_data->notify.handle);
@@ -578,16 +1124,34 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 					p_data->notify.handle);
 			break;
 		}
-		handle->callback(p_data->notify.value,
-					p_data->notify.value_len);
+		link_arrival(p_data->notify.value_len);
+		// Parsed on the ingestion task, not to hold up the stack
+		ingest_put(handle->callback, p_data->notify.value,
+				p_data->notify.value_len);
+		if (!got_data) {
+			got_data = true;
+			ESP_LOGI(TAG, "First data %lld ms after start (%s)",
+				(esp_timer_get_time() - time_start) / 1000,
+				cached ? "cached database"
+				: direct ? "direct connect" : "scan");
+		}
 		break;
 	case ESP_GATTC_WRITE_DESCR_EVT:
 		if (p_data->write.status != ESP_GATT_OK) {
 			ESP_LOGE(TAG, "write descr failed, error status = %x",
 					p_data->write.status);
+			if (cached) {
+				ESP_LOGI(TAG, "Drop the cached database, "
+						"reconnect with discovery");
+				esp_ble_gattc_cache_clean(gattc_remote_bda);
+				rescan = true;
+				esp_ble_gattc_close(gattc_if,
+						p_data->write.conn_id);
+			}
 			break;
 		}
 		ESP_LOGI(TAG, "Write descr success");
+		if (unsubscribed && !--unsubscribed && !saved) lastdev_save();
 		break;
 	case ESP_GATTC_SRVC_CHG_EVT:
 		ESP_LOGI(TAG, "ESP_GATTC_SRVC_CHG_EVT, bd_addr:");
@@ -596,6 +1160,11 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 		break;
 	case ESP_GATTC_WRITE_CHAR_EVT:
 		ESP_LOGD(TAG, "write char status = %x", p_data->write.status);
+		if (p_data->write.status != ESP_GATT_OK) {
+			ESP_LOGE(TAG, "write char failed, error status = %x",
+					p_data->write.status);
+		}
+		wq_done(p_data->write.status == ESP_GATT_OK);
 		break;
 	case ESP_GATTC_DISCONNECT_EVT:
 		ESP_LOGI(TAG, "Disconnect, reason = %d",
@@ -603,27 +1172,23 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 		if (xTimerIsTimerActive(read_rssi_timer) != pdFALSE) {
 			xTimerStop(read_rssi_timer, 0);
 		}
-		if (pp && (pp->stop)) (pp->stop)();
+		if (arrival.count) link_report(esp_timer_get_time());
+		ingest_report();
+		wq_reset();
+		handles_clear();
+		if (pp && !rescan && CONFIG_TINYECG_RECONNECT_MS
+				&& p_data->disconnect.reason !=
+				ESP_GATT_CONN_TERMINATE_LOCAL_HOST) {
+			reconnect_begin();
+			break;
+		}
+		if (pp) ingest_call(pp->stop);
 		pp = NULL;
-		for (handle_t *handle = handles; handle;) {
-			handle_t *old = handle;
-			handle = handle->next;
-			free(old);
-		}
-		handles = NULL;
-		for (srv_profile_t *sp = srvprofs; sp;) {
-			srv_profile_t *old = sp;
-			sp = sp->next;
-			free(old);
-		}
-		srvprofs = NULL;
 		report_found(false);
-		if (p_data->disconnect.reason !=
+		if (rescan || p_data->disconnect.reason !=
 				ESP_GATT_CONN_TERMINATE_LOCAL_HOST) {
 			// Unless disconnect was on our own initiative
-			// Send GAP indication that it can start scanning
-			ESP_ERROR_CHECK(esp_ble_gap_set_scan_params(
-						&scan_params));
+			start_search(true);
 		}
 		break;
 	case ESP_GATTC_CLOSE_EVT:
@@ -638,18 +1203,45 @@ static void esp_gattc_cb(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
 	}
 }
 
-void ble_write(uint16_t handle, uint8_t *data, size_t datalen)
+// Queue a write, false if it cannot be sent: the caller may retry later
+bool ble_write(uint16_t handle, uint8_t *data, size_t datalen)
 {
-	ESP_LOGD(TAG, "ble_write handle 0x%04hx", handle);
-	ESP_LOG_BUFFER_HEX_LEVEL(TAG, data, datalen, ESP_LOG_DEBUG);
-	ESP_ERROR_CHECK(esp_ble_gattc_write_char(
-			saved_gattc_if,
-			gattc_conn_id,
-			handle,
-			datalen,
-			data,
-			ESP_GATT_WRITE_TYPE_RSP,
-			ESP_GATT_AUTH_REQ_NONE));
+	int w;
+
+	assert(datalen <= WMAX);
+	taskENTER_CRITICAL(&wq_lock);
+	for (w = 0; w < nwhandles && whandles[w].handle != handle; w++);
+	if (w == nwhandles) {
+		wstats.refused++;
+		taskEXIT_CRITICAL(&wq_lock);
+		ESP_LOGW(TAG, "ble_write to unknown handle 0x%04hx", handle);
+		return false;
+	}
+	for (int i = 0; i < wq_len; i++) {
+		wcmd_t *cmd = &wq[(wq_head + i) % WQSIZE];
+		if (cmd->handle == handle && cmd->len == datalen
+				&& !memcmp(cmd->data, data, datalen)) {
+			wstats.merged++;
+			taskEXIT_CRITICAL(&wq_lock);
+			return true;
+		}
+	}
+	if (wq_len == WQSIZE) {
+		wstats.refused++;
+		taskEXIT_CRITICAL(&wq_lock);
+		ESP_LOGW(TAG, "ble_write queue full, handle 0x%04hx", handle);
+		return false;
+	}
+	wcmd_t *cmd = &wq[(wq_head + wq_len) % WQSIZE];
+	cmd->handle = handle;
+	cmd->write_nr = whandles[w].write_nr;
+	cmd->len = datalen;
+	memcpy(cmd->data, data, datalen);
+	wq_len++;
+	if (wq_len > wstats.high) wstats.high = wq_len;
+	taskEXIT_CRITICAL(&wq_lock);
+	wq_kick();
+	return true;
 }
 
 bool ble_runner(const periph_t *periphs[])
@@ -675,12 +1267,28 @@ bool ble_runner(const periph_t *periphs[])
 				NULL,
 				initiateConnectCallback
 			);
+	reconnect_timer = xTimerCreate(
+				"Reconnect",
+				1,  // will be set before start
+				pdFALSE,  // one shot timer
+				NULL,
+				reconnectCallback
+			);
+	write_timer = xTimerCreate(
+				"Write timeout",
+				pdMS_TO_TICKS(WQ_TIMEOUT_MS),
+				pdFALSE,  // one shot timer
+				NULL,
+				writeTimeoutCallback
+			);
 	esp_err_t ret = nvs_flash_init();
 	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
 		ESP_ERROR_CHECK(nvs_flash_erase());
 		ret = nvs_flash_init();
 	}
 	ESP_ERROR_CHECK(ret);
+	lastdev_load();
+	ingest_init();
 	ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 	ESP_ERROR_CHECK(esp_bt_controller_init(
 		&(esp_bt_controller_config_t)BT_CONTROLLER_INIT_CONFIG_DEFAULT()));
@@ -696,6 +1304,17 @@ bool ble_runner(const periph_t *periphs[])
 	xSemaphoreTake(btSemaphore, portMAX_DELAY);
 
 	ESP_LOGI(TAG, "Powering down%s", pwrbutton ? " (button press)" : "");
+	// None of them may call into the stack once it is gone. The timer
+	// task runs the pended call after the stops, and after a callback
+	// that may have been running.
+	xTimerStop(read_rssi_timer, portMAX_DELAY);
+	xTimerStop(connect_timer, portMAX_DELAY);
+	xTimerStop(reconnect_timer, portMAX_DELAY);
+	xTimerStop(write_timer, portMAX_DELAY);
+	SemaphoreHandle_t stopped = xSemaphoreCreateBinary();
+	xTimerPendFunctionCall(timers_stopped, stopped, 0, portMAX_DELAY);
+	xSemaphoreTake(stopped, portMAX_DELAY);
+	vSemaphoreDelete(stopped);
 	esp_bluedroid_disable();
 	esp_bluedroid_deinit();
 	esp_bt_controller_disable();
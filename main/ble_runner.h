@@ -21,18 +21,31 @@ typedef struct {
 	const characteristic_t *chars;
 } service_t;
 
+/* Link parameters requested once the periph is set up */
+typedef struct {
+	uint16_t min_int;  // connection interval, 1.25 ms units
+	uint16_t max_int;
+	uint16_t latency;  // connection events the periph may skip
+	uint16_t timeout;  // supervision timeout, 10 ms units
+	uint16_t tx_octets;  // LE data length, 0 to leave the default
+	bool phy_2m;  // prefer 2M PHY, where the stack supports it
+} link_t;
+
 typedef struct {
 	const service_t *srvlist;
 	const char *name;
 	uint16_t uuid;
 	uint16_t delay;
+	uint16_t sps;  // native sample rate, if not SPS
+	const link_t *link;  // NULL to keep what the stack negotiates
 	void (*init)(void);
 	void (*start)(void);
+	void (*pause)(void);  // link lost, start() again when it is back
 	void (*stop)(void);
 } periph_t;
 
 void ble_stop(void);
-void ble_write(uint16_t handle, uint8_t *data, size_t datalen);
+bool ble_write(uint16_t handle, uint8_t *data, size_t datalen);
 bool ble_runner(const periph_t *periphs[]);
 
 #ifdef __cplusplus
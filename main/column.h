@@ -0,0 +1,37 @@
+#ifndef _COLUMN_H
+#define _COLUMN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Range of the samples that go into one display column, and whether
+// they are all real data. Here, so that it can be measured on the host.
+// The count depends on the sweep speed, so it is only known at run
+// time, and the loop is compiled for any count. Copies with the count
+// fixed, picked by a switch, were slower than this on the host, and
+// the target compiler's output has not been looked at.
+static inline bool column(const int8_t *s, const uint8_t *v, int n,
+		int8_t *lo, int8_t *hi)
+{
+	int8_t min = s[0], max = s[0];
+	uint8_t ok = v[0];
+
+	for (int i = 1; i < n; i++) {
+		min = (s[i] < min) ? s[i] : min;
+		max = (s[i] > max) ? s[i] : max;
+		ok &= v[i];
+	}
+	*lo = min;
+	*hi = max;
+	return ok;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _COLUMN_H */
@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sdkconfig.h"
+#include "crc8.h"
+
+/*
+ ***** crc8 for Maxim (Dallas Semiconductor) OneWire bus protocol *****
+ https://github.com/PaulStoffregen/OneWire/blob/master/OneWire.cpp
+
+ Dow-CRC using polynomial X^8 + X^5 + X^4 + X^0
+
+ Three implementations, selected in menuconfig, trading table size
+ for speed: the tiny 2x16 nibble table, the classic 256 entry table
+ processing one byte per lookup, and slicing by 4, processing four
+ bytes per step with four 256 entry tables.
+ */
+
+#if defined(CONFIG_TINYECG_CRC8_NIBBLE)
+
+/*
+ Tiny 2x16 entry CRC table created by Arjen Lentz
+ See http://lentz.com.au/blog/calculating-crc-with-a-tiny-32-entry-lookup-table
+ */
+static const uint8_t dscrc2x16_table[] = {
+	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83,
+	0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
+	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
+	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74,
+};
+
+uint8_t crc8_update(uint8_t crc, const uint8_t *addr, size_t len)
+{
+	while (len--) {
+		crc = *addr++ ^ crc;  // just re-using crc as intermediate
+		crc = dscrc2x16_table[crc & 0x0f] ^
+			dscrc2x16_table[16 + ((crc >> 4) & 0x0f)];
+	}
+	return crc;
+}
+
+#else  /* 256 entry tables */
+
+/*
+ CRC is linear, so the table entry for any byte is the XOR of the
+ entries for its set bits. Tn is the CRC of a byte followed by n zero
+ bytes, which is what slicing needs. These eight "basis" values per
+ table are all we keep in the source, tables are expanded from them
+ by the preprocessor.
+ */
+#define T0_B 0x5E, 0xBC, 0x61, 0xC2, 0x9D, 0x23, 0x46, 0x8C
+#define T1_B 0xC4, 0x91, 0x3B, 0x76, 0xEC, 0xC1, 0x9B, 0x2F
+#define T2_B 0xAB, 0x4F, 0x9E, 0x25, 0x4A, 0x94, 0x31, 0x62
+#define T3_B 0x8F, 0x07, 0x0E, 0x1C, 0x38, 0x70, 0xE0, 0xD9
+
+#define ENTRY_(x, b0, b1, b2, b3, b4, b5, b6, b7) ( \
+	(((x) & 0x01) ? b0 : 0) ^ (((x) & 0x02) ? b1 : 0) ^ \
+	(((x) & 0x04) ? b2 : 0) ^ (((x) & 0x08) ? b3 : 0) ^ \
+	(((x) & 0x10) ? b4 : 0) ^ (((x) & 0x20) ? b5 : 0) ^ \
+	(((x) & 0x40) ? b6 : 0) ^ (((x) & 0x80) ? b7 : 0))
+#define ENTRY(x, ...) ENTRY_(x, __VA_ARGS__)
+#define ROW(x, ...) \
+	ENTRY(x + 0x0, __VA_ARGS__), ENTRY(x + 0x1, __VA_ARGS__), \
+	ENTRY(x + 0x2, __VA_ARGS__), ENTRY(x + 0x3, __VA_ARGS__), \
+	ENTRY(x + 0x4, __VA_ARGS__), ENTRY(x + 0x5, __VA_ARGS__), \
+	ENTRY(x + 0x6, __VA_ARGS__), ENTRY(x + 0x7, __VA_ARGS__), \
+	ENTRY(x + 0x8, __VA_ARGS__), ENTRY(x + 0x9, __VA_ARGS__), \
+	ENTRY(x + 0xa, __VA_ARGS__), ENTRY(x + 0xb, __VA_ARGS__), \
+	ENTRY(x + 0xc, __VA_ARGS__), ENTRY(x + 0xd, __VA_ARGS__), \
+	ENTRY(x + 0xe, __VA_ARGS__), ENTRY(x + 0xf, __VA_ARGS__)
+#define TABLE(...) { \
+	ROW(0x00, __VA_ARGS__), ROW(0x10, __VA_ARGS__), \
+	ROW(0x20, __VA_ARGS__), ROW(0x30, __VA_ARGS__), \
+	ROW(0x40, __VA_ARGS__), ROW(0x50, __VA_ARGS__), \
+	ROW(0x60, __VA_ARGS__), ROW(0x70, __VA_ARGS__), \
+	ROW(0x80, __VA_ARGS__), ROW(0x90, __VA_ARGS__), \
+	ROW(0xa0, __VA_ARGS__), ROW(0xb0, __VA_ARGS__), \
+	ROW(0xc0, __VA_ARGS__), ROW(0xd0, __VA_ARGS__), \
+	ROW(0xe0, __VA_ARGS__), ROW(0xf0, __VA_ARGS__) }
+
+#if defined(CONFIG_TINYECG_CRC8_TABLE)
+
+static const uint8_t dscrc_table[256] = TABLE(T0_B);
+
+uint8_t crc8_update(uint8_t crc, const uint8_t *addr, size_t len)
+{
+	while (len--) {
+		crc = dscrc_table[crc ^ *addr++];
+	}
+	return crc;
+}
+
+#elif defined(CONFIG_TINYECG_CRC8_SLICING4)
+
+static const uint8_t dscrc_tables[4][256] = {
+	TABLE(T0_B),
+	TABLE(T1_B),
+	TABLE(T2_B),
+	TABLE(T3_B),
+};
+
+uint8_t crc8_update(uint8_t crc, const uint8_t *addr, size_t len)
+{
+	while (len >= 4) {
+		crc = dscrc_tables[3][crc ^ addr[0]] ^
+			dscrc_tables[2][addr[1]] ^
+			dscrc_tables[1][addr[2]] ^
+			dscrc_tables[0][addr[3]];
+		addr += 4;
+		len -= 4;
+	}
+	while (len--) {
+		crc = dscrc_tables[0][crc ^ *addr++];
+	}
+	return crc;
+}
+
+#else
+# error "CRC8 implementation must be selected"
+#endif
+
+#endif
+
+uint8_t crc8(const uint8_t *addr, size_t len)
+{
+	return crc8_update(0, addr, len);
+}
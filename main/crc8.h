@@ -0,0 +1,19 @@
+#ifndef _CRC8_H
+#define _CRC8_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint8_t crc8(const uint8_t *addr, size_t len);
+// Continue from the crc of the bytes before, crc8() starts from 0
+uint8_t crc8_update(uint8_t crc, const uint8_t *addr, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CRC8_H */
@@ -1,154 +1,472 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <esp_log.h>
 
 #include "sampling.h"
 #include "data.h"
+#include "resample.h"
 
 #define TAG "data"
 
-SemaphoreHandle_t dataSemaphore;
-
 data_stash_t stash = {};
 
-// Ring buffer is based on read pointer + amount, as we expect
-// 25 times more reads than writes
+/*
+ * Status part of the stash is split in groups, each published under
+ * a seqlock: writer makes the sequence odd, updates the fields and
+ * makes it even again. Reader retries if it saw an odd sequence or if
+ * the sequence changed while it was copying. Groups may have more than
+ * one writer (e.g. state is reported from the BLE task and from main),
+ * so writers of the same group serialize on a spinlock. The reader
+ * never takes it.
+ */
+static struct {
+	size_t off;
+	size_t len;
+	atomic_uint seq;
+	portMUX_TYPE lock;
+} groups[sg_last] = {
+#define GROUP(first, last) { \
+		.off = offsetof(data_stash_t, first), \
+		.len = offsetof(data_stash_t, last) \
+			+ sizeof(((data_stash_t *)0)->last) \
+			- offsetof(data_stash_t, first), \
+		.lock = portMUX_INITIALIZER_UNLOCKED, \
+	}
+	[sg_dyn] = GROUP(energy, heartrate),
+	[sg_link] = GROUP(rssi, rbatt),
+	[sg_local] = GROUP(lbatt, lbatt),
+	[sg_scan] = GROUP(state, found),
+	[sg_hrv] = GROUP(hrv_beats, hrv_pnn50),
+	[sg_qrs] = GROUP(qrs_beats, qrs_hr),
+#undef GROUP
+};
+
+static void group_begin(enum stash_group_e g)
+{
+	taskENTER_CRITICAL(&groups[g].lock);
+	atomic_fetch_add_explicit(&groups[g].seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void group_end(enum stash_group_e g)
+{
+	atomic_fetch_add_explicit(&groups[g].seq, 1, memory_order_release);
+	taskEXIT_CRITICAL(&groups[g].lock);
+}
+
+static uint32_t group_read(enum stash_group_e g, data_stash_t *to)
+{
+	unsigned int seq0, seq1;
+
+	do {
+		while ((seq0 = atomic_load_explicit(&groups[g].seq,
+					memory_order_acquire)) & 1);
+		memcpy((char *)to + groups[g].off,
+				(char *)&stash + groups[g].off,
+				groups[g].len);
+		atomic_thread_fence(memory_order_acquire);
+		seq1 = atomic_load_explicit(&groups[g].seq,
+				memory_order_relaxed);
+	} while (seq0 != seq1);
+	return seq0 >> 1;
+}
+
+// Ring buffer is a single producer (BLE callback) / single consumer
+// (display task) one, and is not protected by any lock. Read and
+// write positions run modulo 2 * BUFSIZE, so that the amount of data
+// can be derived from them, and full and empty states are distinct.
+// Only the consumer moves rdp, only the producer moves wrp.
 #define BUFSIZE 384  // 2.7 seconds worth of data at 150 SPS
+#define IDXMOD (2 * BUFSIZE)
 static int8_t samples[BUFSIZE] = {};
-static uint16_t rdp = 0;
-static uint16_t amount = 0;
+// Samples that were made up to cover the lost ones are marked invalid
+static uint8_t valid[BUFSIZE] = {};
+static _Atomic uint16_t rdp = 0;
+static _Atomic uint16_t wrp = 0;
+// Accounting, in samples: dropped by the producer for lack of space,
+// and made up by the consumer when playing ran out of data. Samples
+// made up while the ring fills up (before the first data, or after
+// the link is lost) are not counted.
+static atomic_bool overrun = false;
+static atomic_uint_least32_t overruns = 0;
+static atomic_uint_least32_t underruns = 0;
+// Gaps in the data reported by the source, and samples made up for them
+static atomic_uint_least32_t gaps = 0;
+static atomic_uint_least32_t concealed = 0;
+static int8_t last_put = 0;  // Last sample committed, to start a gap from
+
+static inline uint16_t ring_amount(uint16_t w, uint16_t r)
+{
+	return (w + IDXMOD - r) % IDXMOD;
+}
+
+/*
+ * Producer side is reserve / commit, so that the sources can decode
+ * straight into the ring storage. Reserved space may be split in two
+ * at the end of the buffer. If there is not enough space, less than
+ * asked is reserved, and the rest (i.e. the newest samples, as the
+ * producer cannot move the read pointer) is accounted as overrun.
+ */
+size_t data_reserve(size_t num, data_span_t *span)
+{
+	uint16_t w = atomic_load_explicit(&wrp, memory_order_relaxed);
+	uint16_t r = atomic_load_explicit(&rdp, memory_order_acquire);
+	size_t avail = BUFSIZE - ring_amount(w, r);
+	size_t wpos = w % BUFSIZE;
+	size_t buf_left = BUFSIZE - wpos;
+
+	if (num > avail) {
+		atomic_fetch_add_explicit(&overruns, num - avail,
+				memory_order_relaxed);
+		atomic_store_explicit(&overrun, true, memory_order_relaxed);
+		num = avail;
+	} else {
+		atomic_store_explicit(&overrun, false, memory_order_relaxed);
+	}
+	span->p[0] = samples + wpos;
+	span->p[1] = samples;
+	if (buf_left >= num) {
+		span->len[0] = num;
+		span->len[1] = 0;
+	} else {
+		span->len[0] = buf_left;
+		span->len[1] = num - buf_left;
+	}
+	return num;
+}
+
+static void ring_commit(size_t num, uint8_t validity)
+{
+	uint16_t w = atomic_load_explicit(&wrp, memory_order_relaxed);
+	size_t wpos = w % BUFSIZE;
+	size_t buf_left = BUFSIZE - wpos;
+
+	if (!num) return;
+	if (buf_left >= num) {
+		memset(valid + wpos, validity, num);
+	} else {
+		memset(valid + wpos, validity, buf_left);
+		memset(valid, validity, num - buf_left);
+	}
+	last_put = samples[(wpos + num - 1) % BUFSIZE];
+	atomic_store_explicit(&wrp, (w + num) % IDXMOD, memory_order_release);
+}
+
+void data_commit(data_stash_t *p_ds, size_t num)
+{
+	ring_commit(num, 1);
+	group_begin(sg_dyn);
+	memcpy(&stash, p_ds, DYNSIZE);
+	group_end(sg_dyn);
+}
+
+// Cover for lost samples, interpolating from the last sample that we
+// have to the first one after the gap.
+void report_gap(size_t num, int8_t next)
+{
+	data_span_t span;
+	size_t got = data_reserve(num, &span);
+
+	for (size_t i = 0; i < got; i++) {
+		*data_span_at(&span, i) = last_put
+			+ (next - last_put) * (int)(i + 1) / (int)(num + 1);
+	}
+	ring_commit(got, 0);
+	atomic_fetch_add_explicit(&gaps, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&concealed, got, memory_order_relaxed);
+}
 
 void report_jumbo(data_stash_t *p_ds, int p_num, int8_t *p_samples)
 {
-	int wrp, avail, buf_left;
-
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		memcpy(&stash, p_ds, DYNSIZE);
-		wrp = (rdp + amount) % BUFSIZE;
-		avail = BUFSIZE - amount;
-		buf_left = BUFSIZE - wrp;
-		if (buf_left >= p_num) {
-			memcpy(samples + wrp, p_samples, p_num);
-		} else {
-			memcpy(samples + wrp, p_samples, buf_left);
-			memcpy(samples, p_samples + buf_left,
-					p_num - buf_left);
-		}
-		if (p_num <= avail) {
-			amount += p_num;
-			stash.overrun = false;
-		} else {
-			amount = BUFSIZE;
-			rdp = (wrp + p_num) % BUFSIZE;
-			stash.overrun = true;
+	data_span_t span;
+	size_t num = data_reserve(resample_count(p_num), &span);
+
+	if (resample_active()) {  // Source runs at another rate
+		int32_t out[RESAMPLE_MAX_UP];
+		size_t got = 0;
+		for (int i = 0; i < p_num; i++) {
+			size_t n = resample(p_samples[i], out);
+			for (size_t j = 0; j < n && got < num; j++) {
+				int32_t v = out[j];
+				*data_span_at(&span, got++) = (v < -120) ? -120
+					: (v > 120) ? 120 : v;
+			}
 		}
-		xSemaphoreGive(dataSemaphore);
+	} else {
+		memcpy(span.p[0], p_samples, span.len[0]);
+		memcpy(span.p[1], p_samples + span.len[0], span.len[1]);
 	}
+	data_commit(p_ds, num);
 }
 
 void report_rssi(uint8_t rssi)
 {
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		stash.rssi = rssi;
-		xSemaphoreGive(dataSemaphore);
-	}
+	group_begin(sg_link);
+	stash.rssi = rssi;
+	group_end(sg_link);
 }
 
 void report_rbatt(uint8_t rbatt)
 {
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		stash.rbatt = rbatt;
-		xSemaphoreGive(dataSemaphore);
-	}
+	group_begin(sg_link);
+	stash.rbatt = rbatt;
+	group_end(sg_link);
 }
 
 void report_lbatt(uint8_t lbatt)
 {
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		stash.lbatt = lbatt;
-		xSemaphoreGive(dataSemaphore);
-	}
+	group_begin(sg_local);
+	stash.lbatt = lbatt;
+	group_end(sg_local);
+}
+
+// Publish the whole group at once, from the same fields of ds
+static void group_write(enum stash_group_e g, data_stash_t *p_ds)
+{
+	group_begin(g);
+	memcpy((char *)&stash + groups[g].off,
+			(char *)p_ds + groups[g].off,
+			groups[g].len);
+	group_end(g);
+}
+
+void report_hrv(data_stash_t *p_ds)
+{
+	group_write(sg_hrv, p_ds);
+}
+
+void report_qrs(data_stash_t *p_ds)
+{
+	group_write(sg_qrs, p_ds);
 }
 
 void report_state(enum state_e st)
 {
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		stash.state = st;
-		xSemaphoreGive(dataSemaphore);
-	}
+	group_begin(sg_scan);
+	stash.state = st;
+	group_end(sg_scan);
 }
 
 void report_periph(char const *name, size_t len)
 {
 	size_t to_copy = (len < sizeof(stash.name))
 			? len : sizeof(stash.name) - 1;
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		strncpy(stash.name, name, to_copy);
-		stash.name[to_copy] = '\0';
-		xSemaphoreGive(dataSemaphore);
-	}
+	group_begin(sg_scan);
+	strncpy(stash.name, name, to_copy);
+	stash.name[to_copy] = '\0';
+	group_end(sg_scan);
 }
 
 void report_found(bool found)
 {
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		stash.found = found;
-		xSemaphoreGive(dataSemaphore);
+	group_begin(sg_scan);
+	stash.found = found;
+	group_end(sg_scan);
+}
+
+/*
+ * Playout control, runs on the consumer side.
+ *
+ * Samples are not played until the ring has filled up to the target
+ * depth, and after an underrun the ring is filled up again. While
+ * playing, the depth is held at the target by dropping or duplicating
+ * single samples. This is a PI controller: deviation of the smoothed
+ * depth from the target gives the proportional term, and its integral
+ * converges to the drift of the producer's clock against ours, which
+ * is what we report. The rate of corrections drives a phase
+ * accumulator, in millionths of a sample, so that the rate in ppm
+ * times the number of samples played can be added to it directly.
+ */
+#define PLAYOUT_TARGET (CONFIG_TINYECG_PLAYOUT_TARGET_MS * SPS / 1000)
+#if (PLAYOUT_TARGET >= BUFSIZE - SPS / FPS)
+# error "Playout target latency does not fit in the ring buffer"
+#endif
+#define PPM 1000000
+#define FILL_SHIFT 4  // Depth is smoothed over 2^4 frames
+#define PLAYOUT_TP 10  // Seconds to bring depth back to target
+#define PLAYOUT_TI 60  // Seconds to settle on the drift estimate
+#define MAX_CORR_PPM 20000  // Do not correct more than 1 sample in 50
+
+static bool playing = false;
+static int32_t fill_avg = 0;  // depth, in 1/256 of a sample
+static int32_t corr_acc = 0;
+static int32_t drift_q8 = 0;  // estimated drift, in 1/256 of ppm
+static uint32_t drops = 0;
+static uint32_t dups = 0;
+
+// Returns 1 if one sample needs to be dropped, -1 if one needs to be
+// duplicated, 0 otherwise.
+static int playout_correction(size_t amount, size_t num)
+{
+	int32_t err, prop, rate;
+
+	fill_avg += (((int32_t)amount << 8) - fill_avg) >> FILL_SHIFT;
+	err = fill_avg - (PLAYOUT_TARGET << 8);
+	prop = (int64_t)err * PPM / (256 * SPS * PLAYOUT_TP);
+	drift_q8 += prop * 256 / (FPS * PLAYOUT_TI);
+	if (drift_q8 > (MAX_CORR_PPM << 8)) drift_q8 = MAX_CORR_PPM << 8;
+	if (drift_q8 < -(MAX_CORR_PPM << 8)) drift_q8 = -(MAX_CORR_PPM << 8);
+	rate = (drift_q8 >> 8) + prop;
+	if (rate > MAX_CORR_PPM) rate = MAX_CORR_PPM;
+	if (rate < -MAX_CORR_PPM) rate = -MAX_CORR_PPM;
+	corr_acc += rate * (int32_t)num;
+	if (corr_acc >= PPM) {
+		corr_acc -= PPM;
+		return 1;
 	}
+	if (corr_acc <= -PPM) {
+		corr_acc += PPM;
+		return -1;
+	}
+	return 0;
 }
 
-static int repeated_underrun = 0;  // To minimise noise in the log
+// Position in the frame where an extra or missing sample will be
+// least visible: where the signal is the flattest.
+static size_t flattest(int8_t *s, size_t num)
+{
+	size_t where = 0;
+	int best = 256;
 
-void get_stash(data_stash_t *newstash, size_t num, int8_t *samples_p)
+	for (size_t i = 0; i + 1 < num; i++) {
+		int d = abs(s[i + 1] - s[i]);
+		if (d < best) {
+			best = d;
+			where = i;
+		}
+	}
+	return where;
+}
+
+static void ring_read(uint16_t *r, int8_t *to, uint8_t *to_valid,
+		size_t num)
 {
-	size_t to_copy, to_repeat, buf_left;
+	int rpos = *r % BUFSIZE;
+	size_t buf_left = BUFSIZE - rpos;
 
-	if (xSemaphoreTake(dataSemaphore, portMAX_DELAY) == pdTRUE) {
-		if (num <= amount) {
+	if (buf_left >= num) {
+		memcpy(to, samples + rpos, num);
+		memcpy(to_valid, valid + rpos, num);
+	} else {
+		memcpy(to, samples + rpos, buf_left);
+		memcpy(to + buf_left, samples, num - buf_left);
+		memcpy(to_valid, valid + rpos, buf_left);
+		memcpy(to_valid + buf_left, valid, num - buf_left);
+	}
+	*r = (*r + num) % IDXMOD;
+}
+
+static int8_t last_sample = 0;  // To fill the gap on underrun
+
+// Take num samples out of the ring, returns how many had to be made up
+static size_t playout(size_t num, int8_t *samples_p, uint8_t *valid_p,
+		size_t *amount_p)
+{
+	size_t amount, to_copy = 0, to_repeat;
+	uint16_t r = atomic_load_explicit(&rdp, memory_order_relaxed);
+	uint16_t w = atomic_load_explicit(&wrp, memory_order_acquire);
+	int corr = 0;
+
+	amount = ring_amount(w, r);
+	if (!playing && amount >= PLAYOUT_TARGET) {
+		ESP_LOGI(TAG, "Start playout with %zu samples", amount);
+		playing = true;
+		fill_avg = amount << 8;
+		corr_acc = 0;
+	}
+	if (playing) {
+		corr = playout_correction(amount, num);
+		if (num + corr <= amount) {
 			to_copy = num;
-			to_repeat = 0;
-			if (repeated_underrun) {
-				ESP_LOGI(TAG, "Underrun happened %d times",
-						repeated_underrun);
-			}
-			repeated_underrun = 0;
-			stash.underrun = false;
-		} else {
+		} else {  // Play what is there, and start filling up again
+			ESP_LOGI(TAG, "Underrun, have %zu samples", amount);
 			to_copy = amount;
-			to_repeat = num - amount;
-			if (!repeated_underrun) {
-				ESP_LOGI(TAG, "Underrun, have %d samples",
-						to_copy);
-			}
-			repeated_underrun++;
-			stash.underrun = true;
-		}
-		buf_left = BUFSIZE - rdp;
-		if (buf_left >= to_copy) {
-			memcpy(samples_p, samples + rdp, to_copy);
-		} else {
-			memcpy(samples_p, samples + rdp, buf_left);
-			memcpy(samples_p + buf_left, samples,
-					to_copy - buf_left);
-		}
-		if (to_repeat) {
-			memset(samples_p + to_copy,
-					samples[(rdp + to_copy - 1) % num],
-					to_repeat);
+			corr = 0;
+			playing = false;
+			atomic_fetch_add_explicit(&underruns, num - amount,
+					memory_order_relaxed);
 		}
-		rdp = (rdp + to_copy) % BUFSIZE;
-		amount -= to_copy;
+	}
+	to_repeat = num - to_copy;
+	if (corr > 0) {  // Merge two neighbouring samples into one
+		int8_t extra;
+		uint8_t extra_valid;
+		ring_read(&r, samples_p, valid_p, num);
+		ring_read(&r, &extra, &extra_valid, 1);
+		size_t i = flattest(samples_p, num);
+		samples_p[i] = (samples_p[i] + samples_p[i + 1]) / 2;
+		valid_p[i] = valid_p[i] && valid_p[i + 1];
+		memmove(samples_p + i + 1, samples_p + i + 2, num - i - 2);
+		memmove(valid_p + i + 1, valid_p + i + 2, num - i - 2);
+		samples_p[num - 1] = extra;
+		valid_p[num - 1] = extra_valid;
+		drops++;
+	} else if (corr < 0) {  // Repeat one sample
+		ring_read(&r, samples_p, valid_p, num - 1);
+		size_t i = flattest(samples_p, num - 1);
+		memmove(samples_p + i + 1, samples_p + i, num - 1 - i);
+		memmove(valid_p + i + 1, valid_p + i, num - 1 - i);
+		dups++;
+	} else {
+		ring_read(&r, samples_p, valid_p, to_copy);
+	}
+	atomic_store_explicit(&rdp, r, memory_order_release);
+	if (to_copy) last_sample = samples_p[to_copy - 1];
+	if (to_repeat) {  // Made up samples are not valid data
+		memset(samples_p + to_copy, last_sample, to_repeat);
+		memset(valid_p + to_copy, 0, to_repeat);
+	}
+	*amount_p = amount;
+	return to_repeat;
+}
+
+// Peripherals that only send timing (heart rate monitors) synthesize
+// the waveform themselves, as it is being displayed.
+static _Atomic(data_source_t) source = NULL;
+
+void data_set_source(data_source_t p_source)
+{
+	atomic_store_explicit(&source, p_source, memory_order_release);
+}
+
+void get_stash(data_stash_t *newstash, size_t num, int8_t *samples_p,
+		uint8_t *valid_p)
+{
+	size_t amount = 0, to_repeat = 0;
+	data_source_t src = atomic_load_explicit(&source,
+			memory_order_acquire);
+
+	if (src) {
+		(src)(samples_p, valid_p, num);
+	} else {
+		to_repeat = playout(num, samples_p, valid_p, &amount);
+	}
 
-		// Do this after maybe updating underrun field
-		memcpy(newstash, &stash, sizeof(stash));
-		xSemaphoreGive(dataSemaphore);
+	for (int g = 0; g < sg_last; g++) {
+		newstash->gen[g] = group_read(g, newstash);
 	}
+	newstash->overrun = atomic_load_explicit(&overrun,
+			memory_order_relaxed);
+	newstash->underrun = (to_repeat != 0);
+	newstash->overruns = atomic_load_explicit(&overruns,
+			memory_order_relaxed);
+	newstash->underruns = atomic_load_explicit(&underruns,
+			memory_order_relaxed);
+	newstash->gaps = atomic_load_explicit(&gaps, memory_order_relaxed);
+	newstash->concealed = atomic_load_explicit(&concealed,
+			memory_order_relaxed);
+	newstash->fill = amount;
+	newstash->drift_ppm = drift_q8 >> 8;
+	newstash->drops = drops;
+	newstash->dups = dups;
 }
 
 void data_init()
 {
-	dataSemaphore = xSemaphoreCreateMutex();
 	memset(&stash, 0, sizeof(stash));
 }
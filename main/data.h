@@ -46,6 +46,19 @@ enum state_e {
 	state_notfound,
 };
 
+/* Status fields are published in groups, each under its own seqlock.
+ * Generation of the group is bumped on every update, so that the reader
+ * can tell if anything in the group could have changed. */
+enum stash_group_e {
+	sg_dyn = 0,	// sensor data that comes with the samples
+	sg_link,	// rssi and remote battery
+	sg_local,	// local battery
+	sg_scan,	// state and scanner results
+	sg_hrv,		// heart rate variability
+	sg_qrs,		// beats detected in the samples
+	sg_last
+};
+
 typedef struct _ds {
 	uint16_t energy;
 	uint16_t volume;
@@ -58,23 +71,66 @@ typedef struct _ds {
 	uint8_t heartrate;
 #define DYNSIZE (offsetof(struct _ds, rssi) - offsetof(struct _ds, energy))
 	uint8_t rssi;
-	uint8_t lbatt;
 	uint8_t rbatt;
-	bool overrun;
-	bool underrun;
+	uint8_t lbatt;
 	enum state_e state;
 	char name[32];
 	bool found;
+	uint16_t hrv_beats;  // RR intervals in the window
+	uint16_t hrv_mean_hr;  // beats per minute
+	uint16_t hrv_min_rr;  // ms
+	uint16_t hrv_max_rr;  // ms
+	uint16_t hrv_sdnn;  // ms
+	uint16_t hrv_rmssd;  // ms
+	uint16_t hrv_pnn50;  // 1/10 of percent
+	uint32_t qrs_beats;
+	uint32_t qrs_time;  // of the last R peak, in samples since start
+	uint16_t qrs_rr;  // ms
+	uint8_t qrs_hr;  // beats per minute, over the last few beats
+	// Below are not part of any group, filled by get_stash()
+	bool overrun;
+	bool underrun;
+	uint32_t overruns;  // samples dropped for lack of space
+	uint32_t underruns;  // samples repeated for lack of data
+	uint32_t gaps;  // gaps in the data reported by the source
+	uint32_t concealed;  // samples made up to cover the gaps
+	uint16_t fill;  // samples in the playout buffer
+	int32_t drift_ppm;  // estimated producer clock drift
+	uint32_t drops;  // samples dropped to hold playout latency
+	uint32_t dups;  // samples duplicated to hold playout latency
+	uint32_t gen[sg_last];
 } data_stash_t;
 
+/* Space in the ring reserved by the producer */
+typedef struct {
+	int8_t *p[2];
+	size_t len[2];
+} data_span_t;
+
+static inline int8_t *data_span_at(data_span_t *span, size_t i)
+{
+	return (i < span->len[0]) ? span->p[0] + i
+				: span->p[1] + (i - span->len[0]);
+}
+
+/* Fills num samples and their validity, called from the display task */
+typedef void (*data_source_t)(int8_t *samples, uint8_t *valid, size_t num);
+
 void report_state(enum state_e state);
 void report_periph(char const *name, size_t len);
 void report_found(bool found);
 void report_jumbo(data_stash_t *ds, int num, int8_t *samples);
+size_t data_reserve(size_t num, data_span_t *span);
+void data_commit(data_stash_t *ds, size_t num);
+void report_gap(size_t num, int8_t next);
 void report_rssi(uint8_t rssi);
 void report_rbatt(uint8_t rbatt);
 void report_lbatt(uint8_t lbatt);
-void get_stash(data_stash_t *newstash, size_t num, int8_t *samples);
+void report_hrv(data_stash_t *ds);
+void report_qrs(data_stash_t *ds);
+void data_set_source(data_source_t source);
+void get_stash(data_stash_t *newstash, size_t num, int8_t *samples,
+		uint8_t *valid);
 void data_init(void);
 
 #ifdef __cplusplus
@@ -1,9 +1,17 @@
 #include <string.h>
 #include <esp_heap_caps.h>
+#include <esp_log.h>
 #include <lvgl.h>
 #include <misc/lv_style.h>
 #include "sampling.h"
+#include "trace.h"
 #include "data.h"
+#include "lvgl_display.h"
+#include "scroll.h"
+#include "column.h"
+#include "display.h"
+
+#define TAG "display"
 
 #if 0
 /* Create a pseudo lv_color_t that will produce byte-swapped r5g6b5 */
@@ -39,18 +47,110 @@ static inline lv_color_t c_swap(lv_color_t o)
  * 			 LV_COORD_MAX, LV_TXT_FLAG_EXPAND);
  */
 
-// Frame outer sizes
-#define HEIGHT 240
-#define MFWIDTH 460
-#define SFWIDTH 70
-// Inner update window
-#define FWIDTH (SPS / FPS)
-#define FHEIGHT (HEIGHT - 10)
-#define FMAX (MFWIDTH - 10)
-#define RAW_BUF_SIZE (FWIDTH * FHEIGHT \
-                * LV_COLOR_FORMAT_GET_SIZE(LV_COLOR_FORMAT_RGB565_SWAPPED))
+/*
+ * Every frame draws a strip of ncols new columns at pos, and erases the
+ * old trace from the strip after it, the gap that marks the sweep. The
+ * two go to the panel as one window, or two when the gap wraps around.
+ * Strips are drawn into a ring of buffers, so that the next one can be
+ * drawn while the previous ones are still being transferred.
+ *
+ * Only what differs from the panel is sent: rows spanned by the new
+ * trace, and by the old one in the gap. For that the vertical extent of
+ * the trace is kept for every column on the panel. Those rows of the
+ * buffer are filled with the grid, and the trace is drawn over it. The
+ * first column of the gap gets the cursor, over the rows that are sent,
+ * and it is kept as the extent of that column, so that the next strip
+ * covers it.
+ *
+ * In the scrolling mode the panel's scroll area covers the trace, and
+ * the panel's frame memory is a ring of strips. The new strip replaces
+ * the oldest one, and the panel is scrolled to show it at the right
+ * edge, so there is no gap to send. The ring is a whole number of
+ * strips at every speed, and of periods of the grid, which is drawn
+ * by the column in frame memory, so that neither breaks where the
+ * ring wraps around.
+ */
+#define NRAWBUFS 3
+#define STRIP_BUF_SIZE (2 * MAXCOLS * FHEIGHT * sizeof(uint16_t))
+#define STATS_FRAMES (10 * FPS)
+
+static uint16_t *strips[NRAWBUFS];
+static int stripidx = 0;
+
+/*
+ * ECG paper grid, 1 mm and 5 mm lines. A millimeter is what the sweep
+ * covers in 1/25 s, and the same vertically. The grid repeats every
+ * 5 mm, and its columns are of three kinds only: a 5 mm line, a 1 mm
+ * line, or the background crossed by the horizontal lines. Columns of
+ * each kind are rendered once, with horizontal 5 mm lines through the
+ * baseline of the trace.
+ */
+#define BASELINE 120  // row of the zero level
+
+enum { tile_plain, tile_minor, tile_major, TILES };
+static uint16_t tile[TILES][FHEIGHT];
+static uint8_t tile_of[TILE_W];  // kind of each column of the period
+
+#if defined(CONFIG_TINYECG_TRACE_SCROLL)
+# define TRACE_MODE trace_scroll
+#else
+# define TRACE_MODE trace_sweep
+#endif
+
+#if defined(CONFIG_TINYECG_SCROLL_MIRRORED)
+# define SCROLL_MIRRORED true
+#else
+# define SCROLL_MIRRORED false
+#endif
+
+static enum trace_mode mode = TRACE_MODE;
+static volatile enum trace_mode want_mode = TRACE_MODE;
+static scroll_t scroll;
+static uint16_t shown;  // start line the panel has
 
-static uint16_t *rawbuf, *clearbuf;
+// Extent of the trace on the panel, top > bot when there is none, and
+// all of the column when the panel has not got the grid there yet
+static uint8_t scr_top[FMAX + MAXCOLS], scr_bot[FMAX + MAXCOLS];
+
+/*
+ * Sweep speed and gain. A frame always takes FSAMPS samples, spread
+ * over ncols columns: at 12.5 mm/s half as many as at 25 mm/s, at
+ * 50 mm/s twice as many, when a sample may cover more than one column.
+ * Which samples go into a column, and which row a value is drawn at,
+ * come from tables that are rebuilt when the setting changes, so that
+ * drawing a frame takes no divisions. The gain of 10 mm/mV is drawn
+ * one row per step of the samples.
+ */
+static const struct {
+	uint8_t cols;  // per frame, in halves of FWIDTH
+	const char *name;
+} speeds[SPEEDS] = {
+	[speed_12_5] = {1, "12.5"},
+	[speed_25] = {2, "25"},
+	[speed_50] = {4, "50"},
+};
+static const uint8_t gains[GAINS] = {
+	[gain_5] = 5,
+	[gain_10] = 10,
+	[gain_20] = 20,
+};
+
+static enum trace_speed speed = speed_25;
+static enum trace_gain gain = gain_10;
+static volatile enum trace_speed want_speed = speed_25;
+static volatile enum trace_gain want_gain = gain_10;
+static int ncols = FWIDTH;
+static uint16_t col_first[MAXCOLS], col_num[MAXCOLS];  // samples
+static uint8_t row_of[256];  // by the sample plus 128
+
+// Time spent waiting for a buffer to come back from the bus, and
+// amount of data sent
+static struct {
+	uint32_t frames;
+	uint32_t total_us;
+	uint32_t max_us;
+	uint32_t bytes;
+} bus;
 
 static void rssi_draw_cb(lv_event_t * e)
 {
@@ -359,20 +459,115 @@ static lv_color_t c_swap(lv_color_t o)
 	};
 }
 
-static uint16_t cursor_color, trace_color;
+static uint16_t trace_color, gap_color, cursor_color;
+
+static void tile_init(void)
+{
+	uint16_t bg = lv_color_to_u16(c_swap(lv_color_black()));
+	uint16_t minor = lv_color_to_u16(c_swap(lv_color_make(56, 16, 16)));
+	uint16_t major = lv_color_to_u16(c_swap(lv_color_make(128, 32, 32)));
+
+	for (int y = 0; y < FHEIGHT; y++) {
+		int row = (y - BASELINE + 5 * MM * FHEIGHT) % (5 * MM);
+		uint16_t line = (row == 0) ? major
+			: (row % MM == 0) ? minor : bg;
+
+		tile[tile_plain][y] = line;
+		tile[tile_minor][y] = (line == major) ? major : minor;
+		tile[tile_major][y] = major;
+	}
+	for (int x = 0; x < TILE_W; x++) {
+		tile_of[x] = (x == 0) ? tile_major
+			: (x % MM == 0) ? tile_minor : tile_plain;
+	}
+}
+
+static void scale_init(void)
+{
+	ncols = FWIDTH * speeds[speed].cols / 2;
+	for (int x = 0; x < ncols; x++) {
+		int first = x * FSAMPS / ncols;
+		int end = (x + 1) * FSAMPS / ncols;
+
+		col_first[x] = first;
+		col_num[x] = (end > first) ? end - first : 1;
+	}
+	for (int v = -128; v < 128; v++) {
+		int row = BASELINE - v * gains[gain] / 10;
+
+		if (row > FHEIGHT - 1) row = FHEIGHT - 1;
+		if (row < 0) row = 0;
+		row_of[v + 128] = row;
+	}
+	ESP_LOGI(TAG, "Sweep %s mm/s, %d columns per frame, %d mm/mV",
+			speeds[speed].name, ncols, gains[gain]);
+}
 
 void display_init(lv_display_t* disp) {
 	/* trace is drawn using raw memory writes, withut lvgl magic.
 	 * It means that we have to make colors with swapped bytes. */
-	cursor_color = lv_color_to_u16(c_swap(lv_color_make(16, 16, 16)));
 	trace_color = lv_color_to_u16(c_swap(lv_color_make(0, 255, 0)));
-	rawbuf = heap_caps_malloc(RAW_BUF_SIZE, MALLOC_CAP_DMA);
-	clearbuf = heap_caps_malloc(RAW_BUF_SIZE, MALLOC_CAP_DMA);
-	assert(rawbuf != NULL && clearbuf != NULL);
-	memset(clearbuf, 0, RAW_BUF_SIZE);
-	for (int y = 0; y < FHEIGHT; y++) {
-		clearbuf[y * FWIDTH] = cursor_color;
+	gap_color = lv_color_to_u16(c_swap(lv_color_make(0, 96, 0)));
+	cursor_color = lv_color_to_u16(c_swap(lv_color_make(96, 96, 96)));
+	tile_init();
+	scale_init();
+	for (int i = 0; i < NRAWBUFS; i++) {
+		strips[i] = heap_caps_malloc(STRIP_BUF_SIZE, MALLOC_CAP_DMA);
+		assert(strips[i] != NULL);
 	}
+	// Screen columns are scan lines of the panel lying on its side
+	scroll_init(&scroll, FBORDER, scroll_ring(FMAX, MAXCOLS, TILE_W),
+			CONFIG_HWE_DISPLAY_HEIGHT, SCROLL_MIRRORED);
+	lvgl_display_scroll_area(scroll.tfa, scroll.vsa, scroll.bfa);
+	lvgl_display_scroll_start(scroll.start);
+	shown = scroll.start;
+}
+
+// Takes effect from the next frame, the screen is redrawn then
+void display_set_mode(enum trace_mode new_mode)
+{
+	want_mode = new_mode;
+}
+
+void display_next_mode(void)
+{
+	want_mode = (want_mode == trace_sweep) ? trace_scroll : trace_sweep;
+}
+
+// 12.5 mm/s needs an even number of columns per frame at 25 mm/s
+static bool speed_ok(enum trace_speed sp)
+{
+	return (FWIDTH * speeds[sp].cols) % 2 == 0;
+}
+
+// Both take effect from the next frame, the trace starts over then
+void display_set_scale(enum trace_speed new_speed, enum trace_gain new_gain)
+{
+	if (new_speed < SPEEDS && speed_ok(new_speed)) want_speed = new_speed;
+	if (new_gain < GAINS) want_gain = new_gain;
+}
+
+void display_next_speed(void)
+{
+	enum trace_speed sp = want_speed;
+
+	do {
+		sp = (sp + 1) % SPEEDS;
+	} while (!speed_ok(sp));
+	want_speed = sp;
+}
+
+void display_next_gain(void)
+{
+	want_gain = (want_gain + 1) % GAINS;
+}
+
+// Scroll the panel once the strips of the frame are pushed
+void display_scroll(void)
+{
+	if (scroll.start == shown) return;
+	lvgl_display_scroll_start(scroll.start);
+	shown = scroll.start;
 }
 
 static void display_welcome(lv_obj_t *scr)
@@ -423,14 +618,48 @@ static void display_stop(lv_obj_t *scr, bool pwrdown)
 static uint32_t pos = 0;
 static int oldvpos = 127;
 
+// The screen is fresh from LVGL, without the grid
+static void trace_reset(void)
+{
+	pos = 0;
+	memset(scr_top, 0, sizeof(scr_top));
+	memset(scr_bot, FHEIGHT - 1, sizeof(scr_bot));
+}
+
+// Grid of a screen column, rows from top to bot, into a buffer column
+static void fill_grid(uint16_t *buf, int stride, uint32_t col,
+		int top, int bot)
+{
+	const uint16_t *t = tile[tile_of[col % TILE_W]];
+
+	for (int y = top; y <= bot; y++) buf[y * stride] = t[y];
+}
+
+static inline int vpos_of(int8_t sample)
+{
+	return row_of[sample + 128];
+}
+
 void display_update(lv_display_t* disp, lv_area_t *where, lv_area_t *clear,
 		uint16_t **pbuf, uint16_t **cbuf)
 {
 	lv_obj_t *scr = lv_display_get_screen_active(disp);
 	data_stash_t new_stash;
-	int8_t samples[FWIDTH];
+	int8_t samples[FSAMPS];
+	uint8_t valid[FSAMPS];
+
+	get_stash(&new_stash, FSAMPS, samples, valid);
 
-	get_stash(&new_stash, FWIDTH, samples);
+	if (want_mode != mode || want_speed != speed || want_gain != gain) {
+		if (want_speed != speed || want_gain != gain) {
+			speed = want_speed;
+			gain = want_gain;
+			scale_init();
+		}
+		mode = want_mode;
+		// Start over on a clean screen, as if the state were new
+		old_stash.state = _state_uninitialized;
+	}
 
 	if (old_stash.state != new_stash.state) switch (new_stash.state) {
 	case state_scanning:
@@ -438,6 +667,7 @@ void display_update(lv_display_t* disp, lv_area_t *where, lv_area_t *clear,
 		break;
 	case state_receiving:
 		display_grid(scr);
+		trace_reset();
 		break;
 	case state_notfound:
 		display_stop(scr, false);
@@ -449,52 +679,62 @@ void display_update(lv_display_t* disp, lv_area_t *where, lv_area_t *clear,
 		break;
 	}
 
+	/* Fields of a group cannot have changed if its generation did not */
+	bool scan_upd = (new_stash.gen[sg_scan] != old_stash.gen[sg_scan]);
+	bool link_upd = (new_stash.gen[sg_link] != old_stash.gen[sg_link]);
+	bool dyn_upd = (new_stash.gen[sg_dyn] != old_stash.gen[sg_dyn]);
+	bool local_upd = (new_stash.gen[sg_local] != old_stash.gen[sg_local]);
+
 	switch (new_stash.state) {
 	case state_scanning:
+		if (!scan_upd) break;
 		lv_obj_clean(update_label);
 		lv_label_set_text_fmt(update_label, "%s: %s",
 				new_stash.found ? "Found" : "Scanning",
 				new_stash.name);
 		break;
 	default:
-		if (new_stash.rssi != old_stash.rssi) {
+		if (link_upd && new_stash.rssi != old_stash.rssi) {
 			lv_obj_set_user_data(indic[RSSI],
 					(void*)((int)new_stash.rssi));
 			lv_obj_invalidate(indic[RSSI]);
 		}
-		if (new_stash.rbatt != old_stash.rbatt) {
+		if (link_upd && new_stash.rbatt != old_stash.rbatt) {
 			// lv_label_set_text_fmt(indic[RBATT], "%d%%",
 			//		new_stash.rbatt);
 			lv_obj_set_user_data(indic[RBATT],
 					(void*)((int)new_stash.rbatt));
 			lv_obj_invalidate(indic[RBATT]);
 		}
-		if (new_stash.heartrate != old_stash.heartrate) {
-			if (new_stash.heartrate) {
-				lv_label_set_text_fmt(indic[HR], "%d",
+		if (dyn_upd) {
+			if (new_stash.heartrate != old_stash.heartrate) {
+				if (new_stash.heartrate) {
+					lv_label_set_text_fmt(indic[HR], "%d",
 						new_stash.heartrate);
-			} else {
-				lv_label_set_text_static(indic[HR], " ");
+				} else {
+					lv_label_set_text_static(indic[HR],
+							" ");
+				}
 			}
-		}
-		if (new_stash.mmode != old_stash.mmode) {
-			lv_obj_set_user_data(indic[MMODE],
+			if (new_stash.mmode != old_stash.mmode) {
+				lv_obj_set_user_data(indic[MMODE],
 					(void*)((int)new_stash.mmode));
-			lv_obj_invalidate(indic[MMODE]);
-		}
-		if (new_stash.mstage != old_stash.mstage) {
-			lv_obj_set_user_data(indic[MSTAGE],
+				lv_obj_invalidate(indic[MMODE]);
+			}
+			if (new_stash.mstage != old_stash.mstage) {
+				lv_obj_set_user_data(indic[MSTAGE],
 					(void*)((int)new_stash.mstage));
-			lv_obj_invalidate(indic[MSTAGE]);
-		}
-		if (new_stash.leadoff != old_stash.leadoff) {
-			//lv_label_set_text_fmt(indic[LEADOFF], "%c",
-			//		new_stash.leadoff ? 'X' : 'O');
-			lv_obj_set_user_data(indic[LEADOFF],
+				lv_obj_invalidate(indic[MSTAGE]);
+			}
+			if (new_stash.leadoff != old_stash.leadoff) {
+				//lv_label_set_text_fmt(indic[LEADOFF], "%c",
+				//		new_stash.leadoff ? 'X' : 'O');
+				lv_obj_set_user_data(indic[LEADOFF],
 					(void*)((int)new_stash.leadoff));
-			lv_obj_invalidate(indic[LEADOFF]);
+				lv_obj_invalidate(indic[LEADOFF]);
+			}
 		}
-		if (new_stash.lbatt != old_stash.lbatt) {
+		if (local_upd && new_stash.lbatt != old_stash.lbatt) {
 			//lv_label_set_text_fmt(indic[LBATT], "%d%%",
 			//		new_stash.lbatt);
 			lv_obj_set_user_data(indic[LBATT],
@@ -504,38 +744,120 @@ void display_update(lv_display_t* disp, lv_area_t *where, lv_area_t *clear,
 		break;
 	}
 	if (new_stash.state == state_receiving) {
-		int ltop, lbot;
-		memset(rawbuf, 0, RAW_BUF_SIZE);
-		for (int x = 0; x < FWIDTH; x++) {
-			int vpos = 120 - samples[x];
-			if (vpos > FHEIGHT - 1) vpos = FHEIGHT - 1;
-			if (vpos < 0) vpos = 0;
-			if (oldvpos < vpos) {  // old is on the top
-				ltop = oldvpos;
-				lbot = vpos;
-			} else {
-				ltop = vpos;
-				lbot = oldvpos;
+		int ltop[MAXCOLS], lbot[MAXCOLS];
+		uint16_t color[MAXCOLS];
+		int top = FHEIGHT, bot = 0;  // rows to send
+		int gtop = FHEIGHT, gbot = 0;  // rows of the old one in the gap
+		uint16_t *buf = strips[stripidx];
+		stripidx = (stripidx + 1) % NRAWBUFS;
+		uint32_t us = lvgl_display_wait_buf(buf, STRIP_BUF_SIZE);
+		bus.total_us += us;
+		if (us > bus.max_us) bus.max_us = us;
+		bool scrolling = (mode == trace_scroll);
+		uint32_t next = scroll_next(pos, ncols,
+				scrolling ? scroll.vsa : FMAX);
+		// The gap follows in the same window, unless it wraps around.
+		// When scrolling, the strip itself replaces the oldest one.
+		uint32_t gap = scrolling ? pos : next;
+		bool joined = !scrolling && next != 0;
+		int stride = joined ? 2 * ncols : ncols;
+		for (uint32_t x = gap; x < gap + ncols; x++) {
+			if (scr_top[x] < gtop) gtop = scr_top[x];
+			if (scr_bot[x] > gbot) gbot = scr_bot[x];
+			scr_top[x] = FHEIGHT;
+			scr_bot[x] = 0;
+		}
+		// Whatever the gap before did not clear, like the whole column
+		// when the grid is not there yet
+		for (uint32_t x = pos; x < pos + ncols; x++) {
+			if (scr_top[x] < top) top = scr_top[x];
+			if (scr_bot[x] > bot) bot = scr_bot[x];
+		}
+		for (int x = 0; x < ncols; x++) {
+			int8_t lo, hi;
+			int first = col_first[x], num = col_num[x];
+			bool ok = column(samples + first, valid + first, num,
+					&lo, &hi);
+			// span of the column, joined to the previous one
+			ltop[x] = vpos_of(hi);
+			lbot[x] = vpos_of(lo);
+			if (oldvpos < ltop[x]) ltop[x] = oldvpos;
+			if (oldvpos > lbot[x]) lbot[x] = oldvpos;
+			// made up samples are drawn dimmed
+			color[x] = ok ? trace_color : gap_color;
+			oldvpos = vpos_of(samples[first + num - 1]);
+			scr_top[pos + x] = ltop[x];
+			scr_bot[pos + x] = lbot[x];
+			if (ltop[x] < top) top = ltop[x];
+			if (lbot[x] > bot) bot = lbot[x];
+		}
+		if (joined || scrolling) {
+			if (gtop < top) top = gtop;
+			if (gbot > bot) bot = gbot;
+		}
+		// Only the rows that are sent need the grid under the trace
+		for (int x = 0; x < ncols; x++) {
+			fill_grid(buf + x, stride, pos + x, top, bot);
+			if (joined) {
+				fill_grid(buf + ncols + x, stride, next + x,
+						top, bot);
 			}
-			for (int y = ltop; y <= lbot; y++) {
-				rawbuf[x + (y * FWIDTH)] = trace_color;
+			for (int y = ltop[x]; y <= lbot[x]; y++) {
+				buf[x + (y * stride)] = color[x];
 			}
-			oldvpos = vpos;
 		}
 		where->x1 = 5 + pos;
-		where->x2 = 4 + FWIDTH + pos;
-		where->y1 = 5;
-		where->y2 = 5 + FHEIGHT - 1;
-		(*pbuf) = rawbuf;
-		pos += FWIDTH;
-		if (pos >= FMAX) pos = 0;
-		clear->x1 = 5 + pos;
-		clear->x2 = 4 + FWIDTH + pos;
-		clear->y1 = 5;
-		clear->y2 = 5 + FHEIGHT - 1;
-		(*cbuf) = clearbuf;
+		where->x2 = 4 + ncols + pos + (joined ? ncols : 0);
+		where->y1 = 5 + top;
+		where->y2 = 5 + bot;
+		(*pbuf) = buf + top * stride;
+		bus.bytes += (bot - top + 1) * stride * sizeof(uint16_t);
+		if (joined) {
+			for (int y = top; y <= bot; y++) {
+				buf[ncols + y * stride] = cursor_color;
+			}
+			scr_top[next] = top;
+			scr_bot[next] = bot;
+		}
+		if (!joined && !scrolling) {
+			uint16_t *gbuf = buf + MAXCOLS * FHEIGHT;
+
+			// The cursor goes with the gap, as high as the strip
+			if (top < gtop) gtop = top;
+			if (bot > gbot) gbot = bot;
+			for (int x = 0; x < ncols; x++) {
+				fill_grid(gbuf + x, ncols, next + x,
+						gtop, gbot);
+			}
+			for (int y = gtop; y <= gbot; y++) {
+				gbuf[y * ncols] = cursor_color;
+			}
+			scr_top[next] = gtop;
+			scr_bot[next] = gbot;
+			clear->x1 = 5 + next;
+			clear->x2 = 4 + ncols + next;
+			clear->y1 = 5 + gtop;
+			clear->y2 = 5 + gbot;
+			(*cbuf) = gbuf + gtop * ncols;
+			bus.bytes += (gbot - gtop + 1) * ncols
+				* sizeof(uint16_t);
+		} else {
+			(*cbuf) = NULL;
+		}
+		pos = next;
+		scroll_set(&scroll, scrolling ? pos : 0);
+		if (++bus.frames == STATS_FRAMES) {
+			ESP_LOGI(TAG, "Bus wait per frame: avg %lu us, max %lu us",
+					bus.total_us / bus.frames, bus.max_us);
+			ESP_LOGI(TAG, "Sent per frame: %lu bytes, was %u",
+					bus.bytes / bus.frames,
+					(unsigned)(2 * ncols * FHEIGHT
+						* sizeof(uint16_t)));
+			memset(&bus, 0, sizeof(bus));
+		}
 	} else {
 		pos = 0;
+		scroll_set(&scroll, 0);
 		(*pbuf) = NULL;
 	}
 	old_stash = new_stash;
@@ -5,9 +5,23 @@
 extern "C" {
 #endif
 
+enum trace_mode {
+	trace_sweep,  // cursor sweeps over the screen
+	trace_scroll,  // newest at the right edge, like a paper chart
+};
+
+enum trace_speed { speed_12_5, speed_25, speed_50, SPEEDS };  // mm/s
+enum trace_gain { gain_5, gain_10, gain_20, GAINS };  // mm/mV
+
 void display_init(lv_display_t* lvgl_display);
 void display_update(lv_display_t* disp, lv_area_t *where, lv_area_t *clear,
 		uint16_t **pbuf, uint16_t **cbuf);
+void display_scroll(void);
+void display_set_mode(enum trace_mode mode);
+void display_next_mode(void);
+void display_set_scale(enum trace_speed speed, enum trace_gain gain);
+void display_next_speed(void);
+void display_next_gain(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,110 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "filter.h"
+#include "filters.h"
+
+/*
+ * Chain of biquad filters, applied to the raw samples before they are
+ * scaled down to 8 bits. Coefficients come from mkfilters.py for the
+ * configured SPS, in Q30. Filters run in direct form I on values with
+ * 8 fractional bits, with 64 bit accumulation: the 0.5 Hz high-pass
+ * has its poles very close to the unit circle, and would otherwise
+ * drown the signal in its own rounding noise.
+ *
+ * The first sample after reset is taken as the steady state of all the
+ * filters, so that the offset of the input does not ring through the
+ * high-pass for seconds.
+ */
+#define FRAC 8
+
+typedef struct {
+	int32_t c[5];  // b0, b1, b2, a1, a2
+	bool dc;  // passes DC through
+} stage_t;
+
+static const stage_t stages[] = {
+#ifdef CONFIG_TINYECG_FILTER_HP
+	{.c = FILTER_HP, .dc = false},
+#endif
+#if defined(CONFIG_TINYECG_FILTER_NOTCH_50)
+# ifndef FILTER_NOTCH50
+#  error "50 Hz notch filter needs SPS over 100"
+# endif
+	{.c = FILTER_NOTCH50, .dc = true},
+#elif defined(CONFIG_TINYECG_FILTER_NOTCH_60)
+# ifndef FILTER_NOTCH60
+#  error "60 Hz notch filter needs SPS over 120"
+# endif
+	{.c = FILTER_NOTCH60, .dc = true},
+#endif
+#ifdef CONFIG_TINYECG_FILTER_LP
+# ifndef FILTER_LP
+#  error "40 Hz low-pass filter needs SPS over 80"
+# endif
+	{.c = FILTER_LP, .dc = true},
+#endif
+};
+#define STAGES (sizeof(stages) / sizeof(stages[0]))
+
+static struct {
+	int32_t x1, x2, y1, y2;
+} state[STAGES ? STAGES : 1];
+static bool primed = false;
+
+static inline int32_t biquad(const int32_t *c, int32_t x, int32_t x1,
+		int32_t x2, int32_t y1, int32_t y2)
+{
+	int64_t acc = (int64_t)c[0] * x + (int64_t)c[1] * x1
+		+ (int64_t)c[2] * x2 - (int64_t)c[3] * y1
+		- (int64_t)c[4] * y2;
+	return (acc + (1LL << (FILTER_SHIFT - 1))) >> FILTER_SHIFT;
+}
+
+static void prime(int32_t x)
+{
+	for (size_t i = 0; i < STAGES; i++) {
+		int32_t y = stages[i].dc ? x : 0;
+		state[i].x1 = state[i].x2 = x;
+		state[i].y1 = state[i].y2 = y;
+		x = y;
+	}
+	primed = true;
+}
+
+int32_t filter_step(int32_t x)
+{
+	x *= 1 << FRAC;
+	if (!primed) prime(x);
+	for (size_t i = 0; i < STAGES; i++) {
+		int32_t y = biquad(stages[i].c, x, state[i].x1, state[i].x2,
+				state[i].y1, state[i].y2);
+		state[i].x2 = state[i].x1;
+		state[i].x1 = x;
+		state[i].y2 = state[i].y1;
+		state[i].y1 = y;
+		x = y;
+	}
+	return (x + (1 << (FRAC - 1))) >> FRAC;
+}
+
+// What filter_step() would return for x, without taking it in
+int32_t filter_peek(int32_t x)
+{
+	x *= 1 << FRAC;
+	if (!primed) return x >> FRAC;
+	for (size_t i = 0; i < STAGES; i++) {
+		x = biquad(stages[i].c, x, state[i].x1, state[i].x2,
+				state[i].y1, state[i].y2);
+	}
+	return (x + (1 << (FRAC - 1))) >> FRAC;
+}
+
+void filter_reset(void)
+{
+	memset(state, 0, sizeof(state));
+	primed = false;
+}
@@ -0,0 +1,16 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void filter_reset(void);
+int32_t filter_step(int32_t x);
+int32_t filter_peek(int32_t x);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FILTER_H */
@@ -1,11 +1,14 @@
 #include <string.h>
+#include <stdatomic.h>
 #include <esp_log.h>
 #include <esp_timer.h>
 
 #include "ble_runner.h"
 #include "hrm.h"
 #include "data.h"
+#include "hrv.h"
 #include "sampling.h"
+#include "beats.h"
 
 #define TAG "HRM"
 
@@ -13,37 +16,102 @@
 #define F_HAS_ENERGY 0x08
 #define F_HAS_RRI 0x10
 
-static int8_t beat[] = {
-  0, 0, 1, 1, 2, 3, 2, 2, 3, 4, 5, 4, 1, -1, -2, -2, -2, -1, -2, -3, -4, -2,
-  0, -1, -6, -6, 13, 55, 99, 114, 90, 39, -5, -21, -14, -2, 3, 2, 0, 0, 0, 0,
-  0, 1, 2, 3, 3, 4, 4, 5, 6, 7, 9, 10, 11, 12, 14, 15, 17, 19, 21, 24, 27, 29,
-  32, 35, 38, 41, 44, 46, 49, 51, 50, 47, 42, 35, 27, 19, 12, 5, 4, 3, 2, 0,
-  -2, -3, -5, -5, -5, -4, -3, -2, -2, -1, -1, 0
-};
+/*
+ * Waveform is synthesized on demand, as the display pulls the samples.
+ * RR intervals received from the monitor are queued, and each one is
+ * played out as a beat followed by the flat line. Lengths are kept in
+ * samples with the remainder carried over, in 1/1000 of a sample, so
+ * that the timing does not drift in the long run. Beat shape follows
+ * the rate: templates for a range of RR intervals are made at build
+ * time by mkbeats.py, and the longest one that fits is used. Playing
+ * starts with one interval in reserve, to absorb the jitter of
+ * notifications. If the queue runs dry, the flat line is made up until
+ * the next interval arrives, and that delay is taken off the following
+ * intervals' flat part.
+ */
+#define RRQSIZE 16  // RR intervals, power of 2
+#define MAX_LAG SPS  // Do not catch up on more than a second
 
-static void makeSamples(int rris, uint16_t rri[], int *nump, int8_t sampp[]) {
-	int filled = 0;
-	int avail = *nump;
+static uint16_t rrq[RRQSIZE];
+// Single producer (BLE callback) / single consumer (display task)
+static _Atomic uint8_t rrq_w = 0;
+static _Atomic uint8_t rrq_r = 0;
+static atomic_bool restart = false;
+static uint32_t rrq_drops = 0;
 
-	for (int i = 0; i < rris; i++) {
-		// RR Interval is expected to come in 1/1024 of a second.
-		// But in realiti is seems to me in milliseconds.
-		// We want SPS (150 / sec) samples.
-		int num = rri[i] * SPS / 1000;
-		if (num > avail) num = avail;
-		int to_copy = sizeof(beat);
-		if (to_copy > num) to_copy = num;
-		int remains = num - to_copy;
-		memcpy(sampp + filled, beat, to_copy);
-		if (remains) memset(sampp + filled + to_copy, 0, remains);
-		filled += num;
-		avail -= num;
+static uint32_t phase = 0;  // in 1/1000 of a sample
+static const int8_t *beat = NULL;  // template of the current beat
+static size_t beat_tlen = 0;
+static size_t beat_len = 0;  // including the flat line after it
+static size_t beat_pos = 0;
+static size_t lag = 0;  // samples made up while waiting for an interval
+static bool playing = false;
+
+static void queue_rri(uint16_t rri)
+{
+	uint8_t w = atomic_load_explicit(&rrq_w, memory_order_relaxed);
+	uint8_t r = atomic_load_explicit(&rrq_r, memory_order_acquire);
+
+	if ((uint8_t)(w - r) >= RRQSIZE) {
+		rrq_drops++;
+		return;
+	}
+	rrq[w % RRQSIZE] = rri;
+	atomic_store_explicit(&rrq_w, w + 1, memory_order_release);
+}
+
+static bool next_beat(void)
+{
+	uint8_t r = atomic_load_explicit(&rrq_r, memory_order_relaxed);
+	uint8_t w = atomic_load_explicit(&rrq_w, memory_order_acquire);
+
+	if (r == w || (!playing && (uint8_t)(w - r) < 2)) return false;
+	playing = true;
+	// RR Interval is expected to come in 1/1024 of a second.
+	// But in realiti is seems to me in milliseconds.
+	// We want SPS (150 / sec) samples.
+	uint16_t rri = rrq[r % RRQSIZE];
+	atomic_store_explicit(&rrq_r, r + 1, memory_order_release);
+	phase += rri * SPS;
+	beat_len = phase / 1000;
+	phase %= 1000;
+	beat_pos = 0;
+	int t = (rri < BEAT_RR_MIN) ? 0 : (rri - BEAT_RR_MIN) / BEAT_RR_STEP;
+	if (t >= BEAT_TEMPLATES) t = BEAT_TEMPLATES - 1;
+	beat = beat_blob + beat_index[t].off;
+	beat_tlen = beat_index[t].len;
+	// Catch up, but do not cut into the beat itself
+	size_t slack = (beat_len > beat_tlen) ? beat_len - beat_tlen : 0;
+	size_t cut = (lag < slack) ? lag : slack;
+	beat_len -= cut;
+	lag -= cut;
+	return true;
+}
+
+static void hrm_synth(int8_t *to, uint8_t *valid, size_t num)
+{
+	if (atomic_exchange_explicit(&restart, false, memory_order_acquire)) {
+		atomic_store_explicit(&rrq_r,
+			atomic_load_explicit(&rrq_w, memory_order_acquire),
+			memory_order_release);
+		phase = 0;
+		beat_len = beat_pos = 0;
+		lag = 0;
+		playing = false;
+	}
+	for (size_t i = 0; i < num; i++) {
+		if (beat_pos < beat_len || next_beat()) {
+			to[i] = (beat_pos < beat_tlen) ? beat[beat_pos] : 0;
+			valid[i] = 1;
+			beat_pos++;
+		} else {
+			to[i] = 0;
+			valid[i] = 0;
+			if (playing && lag < MAX_LAG) lag++;
+		}
 	}
-	(*nump) = filled;
 }
 
-#define SBUFSIZE 1024
-static int8_t samples[SBUFSIZE];
 uint8_t missed = 0;
 
 #ifdef TIME_REPORT
@@ -105,14 +173,15 @@ static void hrm_receive(uint8_t *data, size_t datalen)
 			elapsed, rr_sum, (rr_sum - elapsed),
 			(rr_sum - elapsed) * 100 / elapsed);
 #endif
-	int num = SBUFSIZE;
-	makeSamples(rris, rri, &num, samples);
-	ESP_LOGI(TAG, "Synthesised %d samples", num);
-	report_jumbo(&(data_stash_t){
+	for (int i = 0; i < rris; i++) {
+		queue_rri(rri[i]);
+		hrv_add(rri[i]);
+	}
+	data_commit(&(data_stash_t){
 			.energy = energy,
 			.leadoff = (missed > 3),
 			.heartrate = hr,
-			}, num, samples);
+			}, 0);
 }
 
 static void bat_receive(uint8_t *data, size_t datalen)
@@ -138,7 +207,37 @@ static const service_t services[] = {
 	{0},
 };
 
+static bool running = false;
+
+// Called again without hrm_stop() when the link comes back
+static void hrm_start(void)
+{
+	if (!running) hrv_reset();
+	running = true;
+	atomic_store_explicit(&restart, true, memory_order_release);
+	data_set_source(hrm_synth);
+}
+
+static void hrm_stop(void)
+{
+	running = false;
+	data_set_source(NULL);
+	if (rrq_drops) ESP_LOGI(TAG, "RR intervals dropped: %lu", rrq_drops);
+	rrq_drops = 0;
+}
+
+// One small notification per beat, save the radio power
+static const link_t link_profile = {
+	.min_int = 80,  // 100 ms
+	.max_int = 160,  // 200 ms
+	.latency = 4,
+	.timeout = 600,  // 6 s
+};
+
 const periph_t hrm_desc = {
 	.srvlist = services,
 	.uuid = 0x180D,
+	.link = &link_profile,
+	.start = hrm_start,
+	.stop = hrm_stop,
 };
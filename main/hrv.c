@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "data.h"
+#include "hrv.h"
+
+#define TAG "HRV"
+
+/*
+ * Heart rate variability over a sliding window of RR intervals.
+ *
+ * Intervals are kept in a ring, and the window covers the last
+ * WINDOW_MS worth of them. Every statistic is derived from running
+ * sums that are updated when an interval enters the window and when
+ * the oldest one leaves it, so the work per beat does not depend on
+ * the window size. Minimum and maximum are kept in monotonic queues:
+ * an interval that can never be the minimum again (because a smaller
+ * one came after it) is dropped from the queue of minimums, so the
+ * head of the queue is always the minimum of the window. Square roots
+ * are only taken when the results are published.
+ *
+ * Successive differences are only taken between intervals that really
+ * follow each other: an artefact, or a gap reported by hrv_break(),
+ * ends the chain, and the next interval starts a new one.
+ */
+#define WINDOW_MS (5 * 60 * 1000)
+#define RING 1024  // 5 minutes at 204 BPM, power of 2
+#define MIN_RRI 250  // ms, anything outside is an artefact
+#define MAX_RRI 2500
+#define NN50 50  // ms
+
+static uint16_t rr[RING];
+static uint32_t head = 0;  // sequence number of the next interval
+static uint32_t tail = 0;  // sequence number of the oldest one
+
+static uint32_t sum;  // of intervals
+static uint64_t sum2;  // of squares of intervals
+static uint64_t dsum2;  // of squares of successive differences
+static uint32_t nn50;  // successive differences over 50 ms
+static uint32_t pairs;  // successive differences in the window
+static bool paired[RING];  // interval follows the one before it
+static bool chained;  // next interval follows the newest one
+
+// Queues of sequence numbers, of increasing (mins) and decreasing
+// (maxs) intervals. Never longer than the window, so they can use
+// the same modulo.
+static uint32_t mins[RING], min_head, min_tail;
+static uint32_t maxs[RING], max_head, max_tail;
+
+#define RR(seq) rr[(seq) % RING]
+
+static uint32_t isqrt64(uint64_t v)
+{
+	uint64_t res = 0;
+	uint64_t bit = 1ULL << 62;
+
+	while (bit > v) bit >>= 2;
+	while (bit) {
+		if (v >= res + bit) {
+			v -= res + bit;
+			res = (res >> 1) + bit;
+		} else {
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+	return res;
+}
+
+static void pair_add(uint16_t a, uint16_t b)
+{
+	int32_t d = (int32_t)b - a;
+
+	dsum2 += d * d;
+	if (d > NN50 || d < -NN50) nn50++;
+	pairs++;
+}
+
+static void pair_del(uint16_t a, uint16_t b)
+{
+	int32_t d = (int32_t)b - a;
+
+	dsum2 -= d * d;
+	if (d > NN50 || d < -NN50) nn50--;
+	pairs--;
+}
+
+static void drop_oldest(void)
+{
+	uint16_t v = RR(tail);
+
+	if (head - tail > 1 && paired[(tail + 1) % RING])
+		pair_del(v, RR(tail + 1));
+	sum -= v;
+	sum2 -= (uint32_t)v * v;
+	if (mins[min_tail % RING] == tail) min_tail++;
+	if (maxs[max_tail % RING] == tail) max_tail++;
+	tail++;
+}
+
+static void publish(void)
+{
+	uint32_t n = head - tail;
+	data_stash_t ds = {.hrv_beats = n};
+
+	if (n) {
+		ds.hrv_mean_hr = (60000ULL * n + sum / 2) / sum;
+		ds.hrv_min_rr = RR(mins[min_tail % RING]);
+		ds.hrv_max_rr = RR(maxs[max_tail % RING]);
+	}
+	if (n > 1) {
+		// n * sum2 - sum^2 is n * (n - 1) times the sample variance
+		uint64_t var = (n * sum2 - (uint64_t)sum * sum)
+				/ ((uint64_t)n * (n - 1));
+		ds.hrv_sdnn = isqrt64(var);
+	}
+	if (pairs) {
+		ds.hrv_rmssd = isqrt64(dsum2 / pairs);
+		ds.hrv_pnn50 = nn50 * 1000 / pairs;
+	}
+	report_hrv(&ds);
+}
+
+void hrv_add(uint16_t rri)
+{
+	if (rri < MIN_RRI || rri > MAX_RRI) {
+		ESP_LOGD(TAG, "Ignoring RR interval %hu", rri);
+		chained = false;
+		return;
+	}
+	while (head != tail
+			&& (head - tail >= RING || sum + rri > WINDOW_MS)) {
+		drop_oldest();
+	}
+	paired[head % RING] = (head != tail && chained);
+	if (paired[head % RING]) pair_add(RR(head - 1), rri);
+	chained = true;
+	RR(head) = rri;
+	sum += rri;
+	sum2 += (uint32_t)rri * rri;
+	while (min_head != min_tail && RR(mins[(min_head - 1) % RING]) >= rri)
+		min_head--;
+	mins[min_head++ % RING] = head;
+	while (max_head != max_tail && RR(maxs[(max_head - 1) % RING]) <= rri)
+		max_head--;
+	maxs[max_head++ % RING] = head;
+	head++;
+	publish();
+}
+
+void hrv_reset(void)
+{
+	head = tail = 0;
+	min_head = min_tail = max_head = max_tail = 0;
+	sum = 0;
+	sum2 = dsum2 = 0;
+	nn50 = 0;
+	pairs = 0;
+	chained = false;
+	publish();
+}
+
+// The next interval does not follow the last one, some beats were lost
+void hrv_break(void)
+{
+	chained = false;
+}
@@ -0,0 +1,16 @@
+#ifndef _HRV_H
+#define _HRV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void hrv_reset(void);
+void hrv_add(uint16_t rri);
+void hrv_break(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HRV_H */
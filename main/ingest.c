@@ -0,0 +1,197 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "ingest.h"
+
+#define TAG "ingest"
+
+/*
+ * Notifications are handled on a task of their own, so that parsing
+ * and reporting the data does not hold up the Bluetooth stack. The
+ * stack's callback copies each notification into the next slot of a
+ * static ring and wakes the task up. Single producer, single consumer:
+ * only the stack moves wrp, and only the task moves rdp, once it is
+ * done with the slot, so that the slot is not reused under it.
+ *
+ * Starting and stopping the periph, and the statistics report, go
+ * through the same ring as control slots. They run on the task, in
+ * order with the notifications, so that no callback is still pending
+ * when the periph is stopped, and no state is shared with the stack.
+ */
+#define NSLOTS 16
+#define SLOTSIZE 512  // ble_runner's local MTU, more than any value
+#define IDXMOD (2 * NSLOTS)
+
+typedef struct {
+	void (*callback)(uint8_t *data, size_t datalen);
+	int64_t queued;  // us
+	bool control;  // not a notification, not counted
+	uint16_t len;
+	uint8_t data[SLOTSIZE];
+} slot_t;
+
+static slot_t slots[NSLOTS];
+static _Atomic uint16_t rdp = 0;
+static _Atomic uint16_t wrp = 0;
+static TaskHandle_t task = NULL;
+
+typedef struct {
+	uint64_t total_us;
+	uint32_t max_us;
+} stage_t;
+
+// Updated by the producer, on the stack's task
+typedef struct {
+	uint32_t dropped;
+	uint32_t truncated;
+	uint16_t high;  // of queue depth
+	stage_t copy;  // into the slot
+} pstats_t;
+static pstats_t pstats;
+
+// Updated by the consumer, on the ingestion task
+static struct {
+	uint32_t count;
+	stage_t wait;  // in the queue
+	stage_t handle;  // periph's callback
+} cstats;
+
+static void stage_add(stage_t *stage, uint32_t us)
+{
+	stage->total_us += us;
+	if (us > stage->max_us) stage->max_us = us;
+}
+
+static void ingest_task(void *pvParameter)
+{
+	ESP_LOGI(TAG, "Ingestion task is running on core %d",
+			xPortGetCoreID());
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		uint16_t r = atomic_load_explicit(&rdp, memory_order_relaxed);
+		while (r != atomic_load_explicit(&wrp, memory_order_acquire)) {
+			slot_t *slot = &slots[r % NSLOTS];
+			if (slot->control) {
+				slot->callback(slot->data, slot->len);
+			} else {
+				int64_t t0 = esp_timer_get_time();
+				stage_add(&cstats.wait, t0 - slot->queued);
+				slot->callback(slot->data, slot->len);
+				stage_add(&cstats.handle,
+						esp_timer_get_time() - t0);
+				cstats.count++;
+			}
+			r = (r + 1) % IDXMOD;
+			atomic_store_explicit(&rdp, r, memory_order_release);
+		}
+	}
+}
+
+// Called from the stack's task, false if the queue is full
+bool ingest_put(void (*callback)(uint8_t *data, size_t datalen),
+		const uint8_t *data, size_t datalen)
+{
+	int64_t t0 = esp_timer_get_time();
+	uint16_t w = atomic_load_explicit(&wrp, memory_order_relaxed);
+	uint16_t r = atomic_load_explicit(&rdp, memory_order_acquire);
+	uint16_t depth = (w + IDXMOD - r) % IDXMOD;
+
+	if (depth >= NSLOTS) {
+		pstats.dropped++;
+		return false;
+	}
+	if (datalen > SLOTSIZE) {
+		pstats.truncated++;
+		datalen = SLOTSIZE;
+	}
+	slot_t *slot = &slots[w % NSLOTS];
+	slot->callback = callback;
+	slot->control = false;
+	slot->len = datalen;
+	memcpy(slot->data, data, datalen);
+	slot->queued = t0;
+	atomic_store_explicit(&wrp, (w + 1) % IDXMOD, memory_order_release);
+	if (depth + 1 > pstats.high) pstats.high = depth + 1;
+	xTaskNotifyGive(task);
+	stage_add(&pstats.copy, esp_timer_get_time() - t0);
+	return true;
+}
+
+// Queue a control slot, from the stack's task. Unlike a notification
+// it is not dropped when the queue is full, it waits for room.
+void ingest_control(void (*callback)(uint8_t *data, size_t datalen),
+		const void *data, size_t datalen)
+{
+	uint16_t w = atomic_load_explicit(&wrp, memory_order_relaxed);
+
+	assert(datalen <= SLOTSIZE);
+	while ((w + IDXMOD - atomic_load_explicit(&rdp, memory_order_acquire))
+			% IDXMOD >= NSLOTS) {
+		vTaskDelay(1);
+	}
+	slot_t *slot = &slots[w % NSLOTS];
+	slot->callback = callback;
+	slot->control = true;
+	slot->len = datalen;
+	memcpy(slot->data, data, datalen);
+	slot->queued = esp_timer_get_time();
+	atomic_store_explicit(&wrp, (w + 1) % IDXMOD, memory_order_release);
+	xTaskNotifyGive(task);
+}
+
+static void run_call(uint8_t *data, size_t datalen)
+{
+	void (*fn)(void);
+
+	memcpy(&fn, data, sizeof(fn));
+	fn();
+}
+
+// Run fn on the task, after the notifications queued before it
+void ingest_call(void (*fn)(void))
+{
+	if (fn) ingest_control(run_call, &fn, sizeof(fn));
+}
+
+static void run_report(uint8_t *data, size_t datalen)
+{
+	pstats_t p;
+	uint32_t n = cstats.count ? cstats.count : 1;
+
+	memcpy(&p, data, sizeof(p));
+	if (cstats.count || p.dropped) {
+		ESP_LOGI(TAG, "Notifications %lu, dropped %lu, truncated %lu, "
+				"queue high water %u of %d",
+				cstats.count, p.dropped, p.truncated,
+				p.high, NSLOTS);
+		ESP_LOGI(TAG, "avg/max us: copy %llu/%lu, wait %llu/%lu, "
+				"handle %llu/%lu",
+				p.copy.total_us / n, p.copy.max_us,
+				cstats.wait.total_us / n, cstats.wait.max_us,
+				cstats.handle.total_us / n, cstats.handle.max_us);
+	}
+	memset(&cstats, 0, sizeof(cstats));
+}
+
+// Each side's counters are reset by the side that updates them
+void ingest_report(void)
+{
+	ingest_control(run_report, &pstats, sizeof(pstats));
+	memset(&pstats, 0, sizeof(pstats));
+}
+
+void ingest_init(void)
+{
+	if (task) return;
+	// Same core as the Bluetooth stack, display runs on the other one
+	xTaskCreatePinnedToCore(ingest_task, "ingest", 4096, NULL,
+			CONFIG_TINYECG_INGEST_PRIORITY, &task, 0);
+	assert(task != NULL);
+}
@@ -0,0 +1,20 @@
+#ifndef _INGEST_H
+#define _INGEST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ingest_init(void);
+bool ingest_put(void (*callback)(uint8_t *data, size_t datalen),
+		const uint8_t *data, size_t datalen);
+void ingest_control(void (*callback)(uint8_t *data, size_t datalen),
+		const void *data, size_t datalen);
+void ingest_call(void (*fn)(void));
+void ingest_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _INGEST_H */
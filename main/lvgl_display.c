@@ -1,6 +1,8 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdatomic.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <driver/gpio.h>
 #include <driver/spi_master.h>
 #include <esp_lcd_types.h>
@@ -10,6 +12,7 @@
 #include <esp_heap_caps.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include "esp_lcd_panel_rm67162.h"
 #include "sdkconfig.h"
 #include "lvgl.h"
@@ -33,26 +36,159 @@
 # error "SPI MODE0 or MODE3 must be selected"
 #endif
 
+// Without a DC line, a command goes in the "write register" frame
+#if defined(CONFIG_HWE_DISPLAY_SPI_QSPI)
+# define PANEL_CMD(c) ((0x02 << 24) | ((c) << 8))
+#else
+# define PANEL_CMD(c) (c)
+#endif
+#define CMD_VSCRDEF 0x33  // vertical scrolling definition
+#define CMD_VSCSAD 0x37  // vertical scroll start address
+
 #define SEND_BUF_SIZE ((CONFIG_HWE_DISPLAY_WIDTH * CONFIG_HWE_DISPLAY_HEIGHT \
 	* LV_COLOR_FORMAT_GET_SIZE(LV_COLOR_FORMAT_RGB565_SWAPPED)) / 10)
 
+/*
+ * Transfers to the panel are asynchronous, and complete in the order
+ * they were queued. Pending ones are kept in a FIFO, and every
+ * completion retires the oldest. An entry is either NULL, for a flush
+ * of LVGL's own buffers, that completes the flush, or a raw buffer of
+ * the caller, that may not be written until it is retired. Only the
+ * display task adds entries. The completion callback retires them, or
+ * the display task, when it has waited RETIRE_TIMEOUT for one and none
+ * came, so that a lost completion does not stall the display for good.
+ * Both move the tail with compare and swap, and only one retires.
+ */
+#define PENDING 32  // more than trans_queue_depth, power of 2
+#define RETIRE_TIMEOUT pdMS_TO_TICKS(100)
+
+static const void *pending[PENDING];
+static _Atomic uint32_t pend_head = 0;
+static _Atomic uint32_t pend_tail = 0;
+static SemaphoreHandle_t retired;
+static lv_display_t *display;
+static uint32_t stale;  // entries retired without their completion
+
+static esp_lcd_panel_io_handle_t panel_io;
+
 static bool IRAM_ATTR color_trans_done(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_io_event_data_t *edata, void *user_ctx)
 {
 	lv_display_t *disp = (lv_display_t*)user_ctx;
-	lv_display_flush_ready(disp);
+	BaseType_t woken = pdFALSE;
+	uint32_t t = atomic_load_explicit(&pend_tail, memory_order_relaxed);
+
+	while (t != atomic_load_explicit(&pend_head, memory_order_acquire)) {
+		const void *buf = pending[t % PENDING];
+		if (atomic_compare_exchange_weak_explicit(&pend_tail, &t, t + 1,
+				memory_order_acq_rel, memory_order_relaxed)) {
+			if (!buf) lv_display_flush_ready(disp);
+			break;
+		}
+	}
+	xSemaphoreGiveFromISR(retired, &woken);
 	// Whether a high priority task has been waken up by this function
-	return false; 
+	return woken == pdTRUE;
+}
+
+// Wait for a completion. When none comes, and nothing was retired
+// meanwhile, the oldest transfer is taken as lost, and retired here.
+static void wait_retired(void)
+{
+	uint32_t t = atomic_load_explicit(&pend_tail, memory_order_acquire);
+
+	if (xSemaphoreTake(retired, RETIRE_TIMEOUT) == pdTRUE) return;
+	if (t == atomic_load_explicit(&pend_head, memory_order_relaxed)) return;
+	const void *buf = pending[t % PENDING];
+	if (!atomic_compare_exchange_strong_explicit(&pend_tail, &t, t + 1,
+			memory_order_acq_rel, memory_order_relaxed)) {
+		return;  // the completion came after all
+	}
+	ESP_LOGE(TAG, "No completion in %lu ms, retired %s (%lu so far)",
+			pdTICKS_TO_MS(RETIRE_TIMEOUT),
+			buf ? "a raw buffer" : "a flush", ++stale);
+	if (!buf) lv_display_flush_ready(display);
 }
 
-void lvgl_display_push(lv_display_t *disp_drv, const lv_area_t *area,
+static void pending_add(const void *buf)
+{
+	uint32_t h = atomic_load_explicit(&pend_head, memory_order_relaxed);
+
+	while (h - atomic_load_explicit(&pend_tail, memory_order_acquire)
+			>= PENDING) {
+		wait_retired();
+	}
+	pending[h % PENDING] = buf;
+	atomic_store_explicit(&pend_head, h + 1, memory_order_release);
+}
+
+static bool in_flight(const void *buf, size_t size)
+{
+	uintptr_t from = (uintptr_t)buf;
+	uint32_t h = atomic_load_explicit(&pend_head, memory_order_relaxed);
+	uint32_t t = atomic_load_explicit(&pend_tail, memory_order_acquire);
+
+	for (; t != h; t++) {
+		uintptr_t p = (uintptr_t)pending[t % PENDING];
+
+		if (p >= from && p < from + size) return true;
+	}
+	return false;
+}
+
+static void flush_cb(lv_display_t *disp, const lv_area_t *area,
 		uint8_t *px_map)
 {
-	esp_lcd_panel_handle_t panel_handle =
-		(esp_lcd_panel_handle_t)lv_display_get_user_data(disp_drv);
-	ESP_ERROR_CHECK(esp_lcd_panel_draw_bitmap(panel_handle,
+	pending_add(NULL);
+	ESP_ERROR_CHECK(esp_lcd_panel_draw_bitmap(
+			(esp_lcd_panel_handle_t)lv_display_get_user_data(disp),
 			area->x1, area->y1,
 			area->x2 + 1, area->y2 + 1,
-			(uint16_t *)px_map));
+			px_map));
+}
+
+// Queue a raw buffer to the panel, it must not change until retired
+void lvgl_display_push(lv_display_t *disp, const lv_area_t *area,
+		uint8_t *px_map)
+{
+	pending_add(px_map);
+	ESP_ERROR_CHECK(esp_lcd_panel_draw_bitmap(
+			(esp_lcd_panel_handle_t)lv_display_get_user_data(disp),
+			area->x1, area->y1,
+			area->x2 + 1, area->y2 + 1,
+			px_map));
+}
+
+// Wait until no transfer from within buf is pending, returns the time
+// it took, us
+uint32_t lvgl_display_wait_buf(const void *buf, size_t size)
+{
+	int64_t t0 = esp_timer_get_time();
+
+	while (in_flight(buf, size)) wait_retired();
+	return esp_timer_get_time() - t0;
+}
+
+// Parameters are big endian 16 bit line numbers. Sending waits for
+// the queued transfers to complete, so the panel scrolls only after
+// the strips pushed before have been written.
+void lvgl_display_scroll_area(uint16_t tfa, uint16_t vsa, uint16_t bfa)
+{
+	uint8_t param[] = {
+		tfa >> 8, tfa & 0xff,
+		vsa >> 8, vsa & 0xff,
+		bfa >> 8, bfa & 0xff,
+	};
+
+	ESP_ERROR_CHECK(esp_lcd_panel_io_tx_param(panel_io,
+			PANEL_CMD(CMD_VSCRDEF), param, sizeof(param)));
+}
+
+void lvgl_display_scroll_start(uint16_t line)
+{
+	uint8_t param[] = { line >> 8, line & 0xff };
+
+	ESP_ERROR_CHECK(esp_lcd_panel_io_tx_param(panel_io,
+			PANEL_CMD(CMD_VSCSAD), param, sizeof(param)));
 }
 
 lv_display_t *lvgl_display_init(void)
@@ -103,6 +239,7 @@ lv_display_t *lvgl_display_init(void)
 		},
 	       	&io_handle
 	));
+	panel_io = io_handle;
 	ESP_LOGI(TAG, "Attach vendor specific module");
 	esp_lcd_panel_handle_t panel_handle = NULL;
 	ESP_ERROR_CHECK(esp_lcd_new_panel_rm67162(
@@ -128,10 +265,13 @@ lv_display_t *lvgl_display_init(void)
 	ESP_ERROR_CHECK(gpio_set_level(CONFIG_HWE_DISPLAY_PWR,
 				CONFIG_HWE_DISPLAY_PWR_ON_LEVEL));
 	// panel_handle is ready, now deal with lvgl
+	retired = xSemaphoreCreateBinary();
+	assert(retired != NULL);
 	lv_init();
 	// H and W exchanged because it lies on its side after rotation
 	lv_display_t *disp = lv_display_create(CONFIG_HWE_DISPLAY_WIDTH,
 			CONFIG_HWE_DISPLAY_HEIGHT);
+	display = disp;
 	ESP_ERROR_CHECK(esp_lcd_panel_io_register_event_callbacks(
 		io_handle,
 		&(esp_lcd_panel_io_callbacks_t) {
@@ -139,7 +279,7 @@ lv_display_t *lvgl_display_init(void)
 		},
 	       	disp));
 	lv_display_set_user_data(disp, panel_handle);
-	lv_display_set_flush_cb(disp, lvgl_display_push);
+	lv_display_set_flush_cb(disp, flush_cb);
 	lv_display_set_color_format(disp, LV_COLOR_FORMAT_RGB565_SWAPPED);
 	static lv_color_t *buf[2];
 	for (int i = 0; i < 2; i++) {
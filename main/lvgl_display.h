@@ -7,8 +7,11 @@ extern "C" {
 
 lv_display_t *lvgl_display_init(void);
 void lvgl_display_shut(lv_display_t *disp);
-void lvgl_display_push(lv_display_t *disp_drv, const lv_area_t *area,
+void lvgl_display_push(lv_display_t *disp, const lv_area_t *area,
 		uint8_t *px_map);
+uint32_t lvgl_display_wait_buf(const void *buf, size_t size);
+void lvgl_display_scroll_area(uint16_t tfa, uint16_t vsa, uint16_t bfa);
+void lvgl_display_scroll_start(uint16_t line);
 
 #ifdef __cplusplus
 }
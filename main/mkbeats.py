@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Generate ECG beat templates for the heart rate monitor simulation.
+
+Each beat is a sum of gaussian waves (P, Q, R, S, T) placed relative to
+the R peak. The QT interval follows Bazett's formula, QT = QTc * sqrt(RR),
+and the T wave widens with it. One template is made for every RR bucket,
+cut at the end of the T wave (or at RR, whichever comes first), and all of
+them are packed into one int8 array with an index of offsets and lengths.
+
+Usage: mkbeats.py <samples per second> <output header>
+"""
+
+import math
+import sys
+
+RR_MIN = 300  # ms
+RR_MAX = 1500
+RR_STEP = 50
+
+QTC = 0.40  # s
+START = -0.25  # s before the R peak, where the P wave begins at rest
+LIMIT = 120  # same range as the samples from the PC-80B
+
+
+def waves(rr):
+    """Return (center, width, amplitude) of the waves, times in s,
+    and where the template starts and ends."""
+    scale = math.sqrt(rr)
+    qt = QTC * scale
+    t_width = 0.05 * scale
+    q_onset = -0.04
+    t_end = q_onset + qt
+    # At high rates, shorten the P wave and PR interval instead of
+    # cutting off the T wave.
+    k = min(1, (rr - t_end) / -START)
+    return [
+        (-0.17 * k, 0.025 * k, 8),  # P
+        (-0.025, 0.010, -10),  # Q
+        (0.0, 0.012, 115),  # R
+        (0.030, 0.010, -22),  # S
+        (t_end - 2.5 * t_width, t_width, 48),  # T
+    ], START * k, t_end
+
+
+def template(sps, rr_ms):
+    rr = rr_ms / 1000
+    parts, start, end = waves(rr)
+    length = min(round((end - start) * sps), rr_ms * sps // 1000)
+    out = []
+    for n in range(length):
+        t = start + n / sps
+        v = sum(a * math.exp(-((t - c) / w) ** 2 / 2) for c, w, a in parts)
+        out.append(max(-LIMIT, min(LIMIT, round(v))))
+    return out
+
+
+def main():
+    sps = int(sys.argv[1])
+    blob = []
+    index = []
+    for rr in range(RR_MIN, RR_MAX + 1, RR_STEP):
+        t = template(sps, rr)
+        index.append((len(blob), len(t), rr))
+        blob.extend(t)
+
+    lines = [
+        "// Generated by mkbeats.py for %d SPS, do not edit" % sps,
+        "",
+        "#define BEAT_RR_MIN %d" % RR_MIN,
+        "#define BEAT_RR_STEP %d" % RR_STEP,
+        "#define BEAT_TEMPLATES %d" % len(index),
+        "",
+        "static const int8_t beat_blob[] = {",
+    ]
+    for i in range(0, len(blob), 16):
+        lines.append("\t" + " ".join("%d," % v for v in blob[i:i + 16]))
+    lines += [
+        "};",
+        "",
+        "static const struct {",
+        "\tuint16_t off;",
+        "\tuint16_t len;",
+        "} beat_index[BEAT_TEMPLATES] = {",
+    ]
+    for off, length, rr in index:
+        lines.append("\t{%d, %d},  // RR %d ms" % (off, length, rr))
+    lines.append("};")
+
+    with open(sys.argv[2], "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Generate fixed point biquad coefficients for the ingestion filters.
+
+Coefficients follow the Audio EQ Cookbook by Robert Bristow-Johnson,
+normalized to a0 = 1 and scaled to Q30: {b0, b1, b2, a1, a2}. A filter
+whose frequency is not below Nyquist for the given rate is left out.
+
+Usage: mkfilters.py <samples per second> <output header>
+"""
+
+import math
+import sys
+
+Q = 30
+
+FILTERS = [
+    # name, kind, frequency (Hz), quality
+    ("HP", "highpass", 0.5, 1 / math.sqrt(2)),
+    ("NOTCH50", "notch", 50, 10),
+    ("NOTCH60", "notch", 60, 10),
+    ("LP", "lowpass", 40, 1 / math.sqrt(2)),
+]
+
+
+def biquad(kind, fs, f0, q):
+    w0 = 2 * math.pi * f0 / fs
+    cos = math.cos(w0)
+    alpha = math.sin(w0) / (2 * q)
+    if kind == "highpass":
+        b = [(1 + cos) / 2, -(1 + cos), (1 + cos) / 2]
+    elif kind == "lowpass":
+        b = [(1 - cos) / 2, 1 - cos, (1 - cos) / 2]
+    elif kind == "notch":
+        b = [1, -2 * cos, 1]
+    a0 = 1 + alpha
+    a = [-2 * cos, 1 - alpha]
+    return [v / a0 for v in b + a]
+
+
+def main():
+    sps = int(sys.argv[1])
+    lines = [
+        "// Generated by mkfilters.py for %d SPS, do not edit" % sps,
+        "",
+        "#define FILTER_SHIFT %d" % Q,
+    ]
+    for name, kind, f0, q in FILTERS:
+        if f0 >= sps / 2:
+            continue
+        coefs = [round(c * (1 << Q)) for c in biquad(kind, sps, f0, q)]
+        assert all(-(1 << 31) <= c < (1 << 31) for c in coefs)
+        lines += [
+            "",
+            "// %s %g Hz, Q %.3f" % (kind, f0, q),
+            "#define FILTER_%s {%s}" % (name, ", ".join(map(str, coefs))),
+        ]
+
+    with open(sys.argv[2], "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+if __name__ == "__main__":
+    main()
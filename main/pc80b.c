@@ -6,37 +6,14 @@
 #include "data.h"
 #include "ble_runner.h"
 #include "hrm.h"
+#include "crc8.h"
+#include "filter.h"
+#include "resample.h"
+#include "qrs.h"
+#include "hrv.h"
 
 #define TAG "PC80B"
 
-/*
- ***** crc8 for Maxim (Dallas Semiconductor) OneWire bus protocol *****
- https://github.com/PaulStoffregen/OneWire/blob/master/OneWire.cpp
-
- Dow-CRC using polynomial X^8 + X^5 + X^4 + X^0
- Tiny 2x16 entry CRC table created by Arjen Lentz
- See http://lentz.com.au/blog/calculating-crc-with-a-tiny-32-entry-lookup-table
- */
-
-static const uint8_t dscrc2x16_table[] = {
-	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83,
-	0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
-	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
-	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74,
-};
-
-uint8_t crc8(const uint8_t *addr, uint8_t len)
-{
-	uint8_t crc = 0;
-
-	while (len--) {
-		crc = *addr++ ^ crc;  // just re-using crc as intermediate
-		crc = dscrc2x16_table[crc & 0x0f] ^
-			dscrc2x16_table[16 + ((crc >> 4) & 0x0f)];
-	}
-	return crc;
-}
-
 /* Application part */
 
 static uint16_t write_handle;
@@ -44,13 +21,14 @@ static uint16_t write_handle;
 static void send_cmd(uint8_t opcode, uint8_t *data, uint8_t len)
 {
 	uint8_t buf[64];
-	assert(len + 4 < sizeof(buf));
+	assert(len + 4u < sizeof(buf));
 	buf[0] = 0xa5;
 	buf[1] = opcode;
 	buf[2] = len;
 	memcpy(buf + 3, data, len);
 	buf[3 + len] = crc8(buf, 3 + len);
-	ble_write(write_handle, buf, len + 4);
+	if (!ble_write(write_handle, buf, len + 4))
+		ESP_LOGW(TAG, "Command %02x not sent", opcode);
 }
 
 static TimerHandle_t heartbeat_timer = 0;
@@ -60,10 +38,6 @@ static void heartbeatCallback(TimerHandle_t xTimer)
 	send_cmd(0xff, (uint8_t *)"\0", 1);
 }
 
-#define BLE_MAX 512  // 512 is the max size of BLE characteristic value.
-static uint8_t frame[BLE_MAX] = {};
-static size_t wptr = 0;
-
 static void cmd_devinfo(uint8_t *payload, uint8_t len)
 {
 	ESP_LOGD(TAG, "cmd_devinfo");
@@ -138,7 +112,98 @@ static void cmd_transmode(uint8_t *payload, uint8_t len)
 
 #define SAMPS 25
 
+// Samples come as 12 bit little endian
+static inline int32_t raw_sample(uint8_t *data, size_t i)
+{
+	return (data[i * 2] + (data[i * 2 + 1] << 8)) - 2048;
+}
+
+// Convert filtered sample to our 8 bit format
+static inline int8_t quantize(int32_t value)
+{
+	value /= 4;
+	return (value < -120) ? -120 : (value > 120) ? 120 : value;
+}
+
+static void decode_samples(uint8_t *data, int8_t *to, size_t num)
+{
+	for (size_t i = 0; i < num; i++) {
+		to[i] = quantize(filter_step(raw_sample(data, i)));
+	}
+}
+
+// When the display runs at another rate, resample the raw values
+// before they are filtered and quantized.
+static size_t put_resampled(uint8_t *data)
+{
+	data_span_t span;
+	size_t want = resample_count(SAMPS);
+	size_t num = data_reserve(want, &span);
+	int8_t decoded[SAMPS * RESAMPLE_MAX_UP];
+	int32_t out[RESAMPLE_MAX_UP];
+	size_t got = 0;
+
+	for (size_t i = 0; i < SAMPS; i++) {
+		size_t n = resample(raw_sample(data, i), out);
+		for (size_t j = 0; j < n; j++) {
+			decoded[got++] = quantize(filter_step(out[j]));
+		}
+	}
+	for (size_t i = 0; i < num; i++) *data_span_at(&span, i) = decoded[i];
+	qrs_feed(decoded, got);
+	return num;
+}
+
+// Decode straight into the ring, skipping what did not fit.
+// Beat detection still gets all of the samples.
+static size_t put_samples(uint8_t *data)
+{
+	data_span_t span;
+	size_t num;
+
+	if (resample_active()) return put_resampled(data);
+	num = data_reserve(SAMPS, &span);
+
+	decode_samples(data, span.p[0], span.len[0]);
+	decode_samples(data + span.len[0] * 2, span.p[1], span.len[1]);
+	qrs_feed(span.p[0], span.len[0]);
+	qrs_feed(span.p[1], span.len[1]);
+	if (num < SAMPS) {
+		int8_t rest[SAMPS];
+		decode_samples(data + num * 2, rest, SAMPS - num);
+		qrs_feed(rest, SAMPS - num);
+	}
+	return num;
+}
+
+/*
+ * When frames are lost, fill their place with made up samples, so that
+ * the trace keeps the real time. Longer gaps are not worth covering,
+ * the playout buffer would have run dry anyway.
+ */
+#define MAX_GAP 8  // frames
+
+static void check_seq(const char *what, bool *seq_valid, uint8_t expected,
+		uint8_t seq, uint8_t *data)
+{
+	uint8_t lost = seq - expected;
+
+	if (!*seq_valid) {  // first frame after start
+		*seq_valid = true;
+		return;
+	}
+	if (!lost) return;
+	ESP_LOGE(TAG, "%s wrong sequence: prev %hhu, new %hhu, lost %hhu",
+			what, expected, seq, lost);
+	if (lost > MAX_GAP) return;
+	int8_t next = quantize(filter_peek(raw_sample(data, 0)));
+	size_t num = resample_count(lost * SAMPS);
+	report_gap(num, next);
+	qrs_gap(num, next);
+}
+
 static uint8_t nxtcseq = 0;
+static bool cseq_valid = false;
 
 static void cmd_contdata(uint8_t *payload, uint8_t len)
 {
@@ -168,29 +233,22 @@ static void cmd_contdata(uint8_t *payload, uint8_t len)
 		return;
 	}
 
-	if (d->seq != nxtcseq) {
-		ESP_LOGE(TAG, "Cont wrong sequence: prev %hhu, new %hhu",
-				nxtcseq, d->seq);
-	}
+	check_seq("Cont", &cseq_valid, nxtcseq, d->seq, d->data);
 	nxtcseq = d->seq + 1;
 	uint16_t vol = (d->vol_h << 8) + d->vol_l;
-	int8_t samps[SAMPS];
-	for (int i = 0; i < SAMPS; i++) {
-		int16_t value = ((d->data[i * 2] + (d->data[i * 2 + 1] << 8))
-				- 2048) / 4;
-		samps[i] = (value < -120) ? -120 : (value > 120) ? 120 : value;
-	}
-	report_jumbo(&(data_stash_t){
+	size_t num = put_samples(d->data);
+	data_commit(&(data_stash_t){
 			.volume = vol,
 			.gain = d->gain,
 			.mstage = ms_measuring,
 			.mmode = mm_continuous,
 			.leadoff = d->leadoff,
 			.heartrate = d->hr,
-		}, SAMPS, samps);
+		}, num);
 }
 
 static uint8_t nxtfseq = 0;
+static bool fseq_valid = false;
 
 static void cmd_fastdata(uint8_t *payload, uint8_t len)
 {
@@ -222,18 +280,10 @@ static void cmd_fastdata(uint8_t *payload, uint8_t len)
 		ESP_LOG_BUFFER_HEX_LEVEL(TAG, payload, len, ESP_LOG_ERROR);
 		return;
 	}
-	if (d->seq != nxtfseq) {
-		ESP_LOGE(TAG, "Fast wrong sequence: prev %hhu, new %hhu",
-				nxtfseq, d->seq);
-	}
+	check_seq("Fast", &fseq_valid, nxtfseq, d->seq, d->data);
 	nxtfseq = d->seq + 1;
-	int8_t samps[SAMPS];
-	for (int i = 0; i < SAMPS; i++) {
-		int16_t value = ((d->data[i * 2] + (d->data[i * 2 + 1] << 8))
-				- 2048) / 4;
-		samps[i] = (value < -120) ? -120 : (value > 120) ? 120 : value;
-	}
-	report_jumbo(&(data_stash_t){
+	size_t num = put_samples(d->data);
+	data_commit(&(data_stash_t){
 			.gain = d->gain,
 			.mstage = (enum mstage_e)d->mstage,
 			.mmode = (enum mmode_e)d->mmode,
@@ -241,7 +291,7 @@ static void cmd_fastdata(uint8_t *payload, uint8_t len)
 			.datatype = (enum datatype_e)d->datatype,
 			.leadoff = d->leadoff,
 			.heartrate = d->hr,
-		}, SAMPS, samps);
+		}, num);
 }
 
 static void cmd_heartbeat(uint8_t *payload, uint8_t len)
@@ -265,51 +315,114 @@ static void (* const cmdfunc[16])(uint8_t *payload, uint8_t len) = {
 	[0xf] = cmd_heartbeat,
 };
 
-static void receive(uint8_t *data, size_t datalen)
+/*
+ * Frame is: 0xa5 sync byte, opcode (same nibble twice), payload length,
+ * payload, and crc8 of all the preceding bytes. Stream is parsed byte
+ * by byte, validating every byte as soon as it arrives, with the crc
+ * carried along, and collecting the candidate frame in a ring. When
+ * validation fails, parsing resumes from the next 0xa5 after the
+ * failed sync byte, so bytes already collected are revalidated, and
+ * may hold more than one frame. A failure or a frame only moves the
+ * start of the candidate. Every byte is stored twice, RING apart, so
+ * that the candidate is contiguous from its start, wherever it is.
+ */
+#define FRAME_MAX (3 + 255 + 1)
+#define RING 512  // power of 2, at least FRAME_MAX
+static uint8_t ring[2 * RING];
+static size_t fstart = 0;  // of the candidate, below RING
+static size_t flen = 0;  // bytes collected
+static size_t fpos = 0;  // bytes validated
+static size_t fneed = 0;  // frame length, once known
+static uint8_t fcrc = 0;  // of the bytes validated
+
+static struct {
+	uint32_t frames;
+	uint32_t badcrc;
+	uint32_t badop;
+	uint32_t skipped;
+} pstat;
+
+static void parser_reset(void)
 {
-	if (datalen + wptr > BLE_MAX) {
-		ESP_LOGE(TAG, "Too much data: len = %zu, wptr=%zu",
-				datalen, wptr);
-		wptr = 0;
-	}
-	memcpy(frame + wptr, data, datalen);
-	wptr += datalen;
-	size_t rptr;
-	for (rptr = 0; rptr < wptr; ) {
-		uint8_t flen = frame[rptr + 2] + 4;
-		if (rptr + flen > wptr) {  // Frame incomplete
-			break;
+	fstart = 0;
+	flen = 0;
+	fpos = 0;
+	fcrc = 0;
+	memset(&pstat, 0, sizeof(pstat));
+}
+
+static void parser_resync(void)
+{
+	size_t next;
+
+	for (next = 1; next < flen && ring[fstart + next] != 0xa5; next++);
+	pstat.skipped += next;
+	fstart = (fstart + next) % RING;
+	flen -= next;
+	fpos = 0;
+	fcrc = 0;
+}
+
+static void parser_step(void)
+{
+	uint8_t *frame = ring + fstart;
+	uint8_t b = frame[fpos];
+
+	switch (fpos) {
+	case 0:
+		if (b != 0xa5) {
+			parser_resync();
+			return;
+		}
+		break;
+	case 1:
+		if ((b & 0xf) != (b >> 4)) {
+			ESP_LOGD(TAG, "Bad opcode 0x%02hhx", b);
+			pstat.badop++;
+			parser_resync();
+			return;
 		}
-		uint8_t crc = crc8(frame + rptr, flen - 1);
-		uint8_t fidx;
-		if ((frame[rptr] == 0xa5) &&
-				(crc == frame[rptr + flen - 1]) &&
-				((fidx = (frame[rptr + 1] & 0xf)) ==
-					(frame[rptr + 1] >> 4))) {
-			if (cmdfunc[fidx]) {
-				(*cmdfunc[fidx])(frame + rptr + 3, flen - 4);
-			} else {
-				ESP_LOGE(TAG, "Unhandled opcode 0x%01hhx",
-					frame[rptr + 1]);
-				ESP_LOG_BUFFER_HEX_LEVEL(TAG, data, datalen,
+		break;
+	case 2:
+		fneed = b + 4;
+		break;
+	default:
+		if (fpos < fneed - 1) break;
+		if (fcrc != b) {
+			ESP_LOGE(TAG, "Opcode 0x%02hhx, crc calculated 0x%02hhx,"
+				" provided 0x%02hhx", frame[1], fcrc, b);
+			ESP_LOG_BUFFER_HEX_LEVEL(TAG, frame, fneed,
 					ESP_LOG_ERROR);
-			}
+			pstat.badcrc++;
+			parser_resync();
+			return;
+		}
+		pstat.frames++;
+		if (cmdfunc[frame[1] & 0xf]) {
+			(*cmdfunc[frame[1] & 0xf])(frame + 3, fneed - 4);
 		} else {
-			ESP_LOGE(TAG, "Tag 0x%01hhx, opcode 0x%01hhx, crc"
-				" calculated 0x%01hhx, provided 0x%01hhx",
-					frame[rptr],
-					frame[rptr + 1],
-					crc,
-					frame[rptr + flen - 1]);
-			ESP_LOG_BUFFER_HEX_LEVEL(TAG, data, datalen,
+			ESP_LOGE(TAG, "Unhandled opcode 0x%02hhx", frame[1]);
+			ESP_LOG_BUFFER_HEX_LEVEL(TAG, frame, fneed,
 					ESP_LOG_ERROR);
 		}
-		rptr += flen;
+		// Bytes after the frame, left from a resync, are parsed next
+		fstart = (fstart + fneed) % RING;
+		flen -= fneed;
+		fpos = 0;
+		fcrc = 0;
+		return;
 	}
-	if (wptr - rptr) {
-		memmove(frame, frame + rptr, wptr - rptr);
+	fcrc = crc8_update(fcrc, &b, 1);
+	fpos++;
+}
+
+static void receive(uint8_t *data, size_t datalen)
+{
+	for (size_t i = 0; i < datalen; i++) {
+		size_t at = (fstart + flen++) % RING;
+		ring[at] = ring[at + RING] = data[i];
+		while (fpos < flen) parser_step();
 	}
-	wptr -= rptr;
 }
 
 static void get_write_handle(uint8_t *data, size_t datalen)
@@ -318,10 +431,21 @@ static void get_write_handle(uint8_t *data, size_t datalen)
 	write_handle = *(uint16_t*)data;
 }
 
+static bool running = false;
+
+// Called again without stop() when the link comes back after a dropout
 static void start(void)
 {
-	ESP_LOGI(TAG, "start()");
-	wptr = 0;
+	ESP_LOGI(TAG, "start()%s", running ? ", resuming" : "");
+	parser_reset();
+	if (!running) {
+		cseq_valid = false;
+		fseq_valid = false;
+		filter_reset();
+		qrs_reset();
+		hrv_reset();
+		running = true;
+	}
 	if (xTimerStart(heartbeat_timer, 0) != pdPASS) {
 		ESP_LOGE(TAG, "failed to start heartbeat_timer");
 	}
@@ -332,7 +456,19 @@ static void start(void)
 static void stop(void)
 {
 	ESP_LOGI(TAG, "stop()");
-	wptr = 0;
+	running = false;
+	ESP_LOGI(TAG, "Frames %lu, bad crc %lu, bad opcode %lu, skipped %lu",
+			pstat.frames, pstat.badcrc, pstat.badop, pstat.skipped);
+	parser_reset();
+	if (xTimerIsTimerActive(heartbeat_timer) != pdFALSE) {
+		xTimerStop(heartbeat_timer, 0);
+	}
+}
+
+// Nothing to send to while the link is down
+static void pause(void)
+{
+	ESP_LOGI(TAG, "pause()");
 	if (xTimerIsTimerActive(heartbeat_timer) != pdFALSE) {
 		xTimerStop(heartbeat_timer, 0);
 	}
@@ -361,11 +497,24 @@ static const service_t services[] = {
 	{0},
 };
 
+// 6 frames of 56 bytes per second, in single packets with DLE
+static const link_t link_profile = {
+	.min_int = 24,  // 30 ms
+	.max_int = 40,  // 50 ms
+	.latency = 0,
+	.timeout = 400,  // 4 s
+	.tx_octets = 251,
+	.phy_2m = true,
+};
+
 const periph_t pc80b_desc = {
 	.srvlist = services,
 	.name = "PC80B-BLE",
 	.delay = 3,
+	.sps = 150,
+	.link = &link_profile,
 	.init = init,
 	.start = start,
+	.pause = pause,
 	.stop = stop,
 };
@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "sampling.h"
+#include "data.h"
+#include "hrv.h"
+#include "qrs.h"
+
+#define TAG "QRS"
+
+/*
+ * Streaming R peak detector, after Pan and Tompkins (1985), in integer
+ * arithmetic. Every sample goes through a band-pass filter, derivative,
+ * squaring and moving window integration, a constant amount of work.
+ * Peaks of the integrated signal are classified as QRS or noise against
+ * a threshold that adapts to running estimates of both levels. If no
+ * beat is found for much longer than the recent RR intervals, the
+ * biggest peak above half the threshold is taken as one after all.
+ *
+ * Filter lengths of the original are for 200 SPS, here they are scaled
+ * to SPS. A peak of the integrated signal comes DELAY samples after the
+ * R wave: group delay of the filters, plus some 25 ms because most of
+ * the energy of the QRS complex is after the R peak.
+ */
+#define LPN (6 * SPS / 200)  // low pass, two moving sums, ~11 Hz
+#define HPN (32 * SPS / 200)  // high pass, sample minus moving mean, ~5 Hz
+#define MWN (SPS * 150 / 1000)  // integration window, 150 ms
+#define DELAY ((LPN - 1) + HPN / 2 + 2 + (MWN - 1) / 2 + SPS / 40)
+#define LEARN (2 * SPS)  // samples to take initial levels from
+#define REFRACTORY (SPS / 5)  // 200 ms
+#define RRS 8  // RR intervals averaged for the heart rate
+#define MAX_RR (3 * SPS)  // longer is a lost signal, not an interval
+
+static uint32_t now;  // sample counter
+static int8_t last_in;
+
+// Delay lines and running sums of the filters
+static int8_t lp1[LPN];
+static int32_t lp2[LPN];
+static int32_t hp[HPN];
+static int32_t dv[4];
+static uint32_t mw[MWN];
+static int32_t lp1_sum, lp2_sum, hp_sum;
+static uint32_t mw_sum;
+
+static uint32_t pk_level, pk_time;  // highest since the last peak
+
+static uint32_t spki, npki;  // signal and noise peak levels
+static uint32_t learn_max;
+static uint32_t last_beat;  // when the last one was detected
+static bool have_beat;
+
+// Biggest rejected peak since the last beat, for search back
+static uint32_t cand_level, cand_time;
+
+static uint16_t rrs[RRS];  // in samples
+static uint32_t rr_sum;
+static int rr_n, rr_pos;
+static uint32_t beats;
+
+static uint32_t threshold(void)
+{
+	return npki + (spki - npki) / 4;
+}
+
+static void beat(uint32_t t, uint32_t level, bool searchback)
+{
+	if (searchback) {
+		spki = (level + 3 * spki) / 4;
+	} else {
+		spki = (level + 7 * spki) / 8;
+	}
+	cand_level = 0;
+	beats++;
+	if (!have_beat) {
+		have_beat = true;
+		last_beat = t;
+		return;
+	}
+	uint32_t rr = t - last_beat;
+	last_beat = t;
+	if (rr > MAX_RR) {  // Start over, from this beat as the first
+		rr_sum = 0;
+		rr_n = rr_pos = 0;
+		hrv_break();
+		return;
+	}
+	if (rr_n == RRS) rr_sum -= rrs[rr_pos];
+	else rr_n++;
+	rrs[rr_pos] = rr;
+	rr_sum += rr;
+	rr_pos = (rr_pos + 1) % RRS;
+
+	uint16_t rr_ms = rr * 1000 / SPS;
+	uint32_t hr = (60 * SPS * rr_n + rr_sum / 2) / rr_sum;
+	hrv_add(rr_ms);
+	report_qrs(&(data_stash_t){
+			.qrs_beats = beats,
+			.qrs_time = t - DELAY,
+			.qrs_rr = rr_ms,
+			.qrs_hr = (hr > 255) ? 255 : hr,
+		});
+}
+
+static void peak(uint32_t level, uint32_t t)
+{
+	if (now < LEARN) {
+		if (level > learn_max) learn_max = level;
+		return;
+	}
+	if (have_beat && t - last_beat < REFRACTORY) return;
+	if (level > threshold()) {
+		beat(t, level, false);
+	} else {
+		npki = (level + 7 * npki) / 8;
+		if (level > cand_level) {
+			cand_level = level;
+			cand_time = t;
+		}
+	}
+}
+
+static void step(int8_t x)
+{
+	int idx;
+
+	// Low pass: two moving sums of LPN samples, gain LPN^2
+	idx = now % LPN;
+	lp1_sum += x - lp1[idx];
+	lp1[idx] = x;
+	lp2_sum += lp1_sum - lp2[idx];
+	lp2[idx] = lp1_sum;
+	// High pass: middle of the window minus the mean of it
+	idx = now % HPN;
+	hp_sum += lp2_sum - hp[idx];
+	int32_t mid = hp[(now + HPN - HPN / 2) % HPN];
+	hp[idx] = lp2_sum;
+	int32_t h = mid - hp_sum / HPN;
+	// Five point derivative, squared
+	int32_t d = (2 * h + dv[(now + 3) % 4] - dv[(now + 1) % 4]
+			- 2 * dv[now % 4]) / 8;
+	dv[now % 4] = h;
+	uint32_t sq = (uint32_t)(d * d) >> 4;
+	// Moving window integration
+	idx = now % MWN;
+	mw_sum += sq - mw[idx];
+	mw[idx] = sq;
+	uint32_t m = mw_sum / MWN;
+
+	// A peak counts once the signal has fallen to half of it
+	if (m > pk_level) {
+		pk_level = m;
+		pk_time = now;
+	} else if (m <= pk_level / 2) {
+		peak(pk_level, pk_time);
+		pk_level = m;
+		pk_time = now;
+	}
+
+	if (now == LEARN) {
+		spki = learn_max / 2;
+		npki = learn_max / 8;
+	}
+	// Search back for a missed beat
+	if (have_beat && rr_n && cand_level > threshold() / 2
+			&& now - last_beat > rr_sum * 166 / (100 * rr_n)) {
+		beat(cand_time, cand_level, true);
+	}
+	now++;
+	last_in = x;
+}
+
+void qrs_feed(const int8_t *samples, size_t num)
+{
+	for (size_t i = 0; i < num; i++) step(samples[i]);
+}
+
+// Keep the timing across lost samples, the same way they are concealed
+void qrs_gap(size_t num, int8_t next)
+{
+	int8_t from = last_in;
+
+	for (size_t i = 0; i < num; i++) {
+		step(from + (next - from) * (int)(i + 1) / (int)(num + 1));
+	}
+}
+
+void qrs_reset(void)
+{
+	if (beats) ESP_LOGI(TAG, "Detected %lu beats", beats);
+	now = 0;
+	last_in = 0;
+	memset(lp1, 0, sizeof(lp1));
+	memset(lp2, 0, sizeof(lp2));
+	memset(hp, 0, sizeof(hp));
+	memset(dv, 0, sizeof(dv));
+	memset(mw, 0, sizeof(mw));
+	lp1_sum = lp2_sum = hp_sum = 0;
+	mw_sum = 0;
+	pk_level = pk_time = 0;
+	spki = npki = learn_max = 0;
+	have_beat = false;
+	last_beat = 0;
+	cand_level = cand_time = 0;
+	rr_sum = 0;
+	rr_n = rr_pos = 0;
+	beats = 0;
+	report_qrs(&(data_stash_t){});
+}
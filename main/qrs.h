@@ -0,0 +1,16 @@
+#ifndef _QRS_H
+#define _QRS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void qrs_reset(void);
+void qrs_feed(const int8_t *samples, size_t num);
+void qrs_gap(size_t num, int8_t next);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _QRS_H */
@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <esp_log.h>
+
+#include "resample.h"
+
+#define TAG "resample"
+
+/*
+ * Streaming polyphase resampler by a rational factor L/M.
+ *
+ * Conceptually the input is upsampled by L, low-pass filtered and
+ * decimated by M. Only the branches of the filter that produce output
+ * are ever computed: each output is a dot product of the last TAPS
+ * inputs with the coefficients of one phase. The position of the next
+ * output between the two newest inputs is kept in 1/L of an input
+ * sample, so the ratio is exact and nothing drifts.
+ *
+ * The table is designed when a source with another rate connects: a
+ * Kaiser windowed sinc, cut off below the lower of the two Nyquist
+ * frequencies, with every phase normalized to unity gain at DC. When
+ * decimating, the cut off is lower, and the filter gets longer to keep
+ * its steepness. The table has room for MAX_COEFS coefficients. When
+ * L phases do not fit, it holds fewer, and an output uses the nearest
+ * one below, which is off by less than one phase step: 1/64 of a
+ * sample with TAPS, down to 1/16 with MAX_TAPS when decimating by 4
+ * or more.
+ * Latency is half the filter length, in input samples.
+ */
+#define TAPS 24  // per phase, when not decimating
+#define MAX_TAPS 96
+#define MAX_COEFS 1536
+#define COEF_SHIFT 14
+#define CUTOFF 0.85  // of the lower Nyquist frequency
+#define BETA 7.0  // of the Kaiser window, about -70 dB side lobes
+
+static int16_t coefs[MAX_COEFS];  // phase after phase
+static int32_t hist[2 * MAX_TAPS];  // doubled, so a window is contiguous
+static unsigned hpos;
+static unsigned up, down, phases, taps;
+static unsigned frac;  // of the next output, in 1/up of a sample
+static bool active = false;
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Modified Bessel function of the first kind, order 0
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void design(double fc)
+{
+	double norm = bessel_i0(BETA);
+
+	for (unsigned p = 0; p < phases; p++) {
+		int16_t *c = coefs + p * taps;
+		double h[MAX_TAPS], sum = 0;
+		int32_t isum = 0;
+
+		for (unsigned t = 0; t < taps; t++) {
+			// Distance of the output from hist tap t, in samples
+			double d = ((int)taps / 2 - 1 - (int)t)
+				+ (double)p / phases;
+			double r = d / (taps / 2);
+			double w = (fabs(r) < 1)
+				? bessel_i0(BETA * sqrt(1 - r * r)) / norm : 0;
+			double s = (d == 0) ? 1 : sin(M_PI * fc * d)
+							/ (M_PI * fc * d);
+			h[t] = fc * s * w;
+			sum += h[t];
+		}
+		for (unsigned t = 0; t < taps; t++) {
+			c[t] = lround(h[t] / sum * (1 << COEF_SHIFT));
+			isum += c[t];
+		}
+		// Put the rounding error where it matters least
+		c[taps / 2 - 1] += (1 << COEF_SHIFT) - isum;
+	}
+}
+
+void resample_init(unsigned from_sps, unsigned to_sps)
+{
+	unsigned g;
+
+	active = false;
+	if (!from_sps || from_sps == to_sps) return;
+	g = gcd(from_sps, to_sps);
+	up = to_sps / g;
+	down = from_sps / g;
+	if (up > RESAMPLE_MAX_UP * down) {
+		ESP_LOGE(TAG, "Cannot resample %u to %u SPS",
+				from_sps, to_sps);
+		return;
+	}
+	double ratio = (from_sps < to_sps) ? 1.0 : (double)to_sps / from_sps;
+	taps = 2 * (unsigned)ceil(TAPS / 2 / ratio);
+	if (taps > MAX_TAPS) taps = MAX_TAPS;
+	phases = (up < MAX_COEFS / taps) ? up : MAX_COEFS / taps;
+	design(CUTOFF * ratio);
+	memset(hist, 0, sizeof(hist));
+	hpos = 0;
+	frac = 0;
+	active = true;
+	ESP_LOGI(TAG, "Resampling %u to %u SPS, %u/%u, %u phases of %u",
+			from_sps, to_sps, up, down, phases, taps);
+}
+
+bool resample_active(void)
+{
+	return active;
+}
+
+// How many outputs num more inputs will produce
+size_t resample_count(size_t num)
+{
+	uint64_t end = (uint64_t)num * up;
+
+	if (!active) return num;
+	if (end <= frac) return 0;
+	return (end - frac + down - 1) / down;
+}
+
+// Take one input sample, returns how many outputs it produced
+size_t resample(int32_t x, int32_t *out)
+{
+	size_t n = 0;
+
+	if (!active) {
+		out[0] = x;
+		return 1;
+	}
+	hist[hpos] = hist[hpos + taps] = x;
+	hpos = (hpos + 1) % taps;
+	while (frac < up) {
+		const int16_t *c = coefs + (frac * phases / up) * taps;
+		const int32_t *h = hist + hpos;  // oldest first
+		int64_t acc = 0;
+
+		for (unsigned t = 0; t < taps; t++) {
+			acc += (int64_t)c[t] * h[t];
+		}
+		out[n++] = (acc + (1 << (COEF_SHIFT - 1))) >> COEF_SHIFT;
+		frac += down;
+	}
+	frac -= up;
+	return n;
+}
@@ -0,0 +1,19 @@
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESAMPLE_MAX_UP 8  // outputs per input sample at most
+
+void resample_init(unsigned from_sps, unsigned to_sps);
+bool resample_active(void);
+size_t resample_count(size_t num);
+size_t resample(int32_t x, int32_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RESAMPLE_H */
@@ -8,6 +8,7 @@ extern "C" {
 #endif
 
 #define SPS CONFIG_TINYECG_SPS
+#define CPS CONFIG_TINYECG_CPS  // display columns per second
 
 #if defined(CONFIG_TINYECG_FPS_25)
 # define FPS 25
@@ -23,6 +24,15 @@ extern "C" {
 #if (SPS % FPS)
 # error "SPS must be a multiple of FPS"
 #endif
+#if (SPS % CPS)
+# error "SPS must be a multiple of CPS"
+#endif
+#if (CPS % FPS)
+# error "CPS must be a multiple of FPS"
+#endif
+#if (CPS % 25)
+# error "CPS must be a multiple of 25, a millimetre at 25 mm/s"
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "scroll.h"
+
+/*
+ * Model of the vertical scrolling of a MIPI DCS panel (VSCRDEF and
+ * VSCSAD). Scan lines of the panel are split into a fixed top area, a
+ * scroll area and a fixed bottom area. Lines of the scroll area show
+ * the frame memory starting from the start line, wrapping around to
+ * the first line of the area. Writes to the frame memory are not
+ * affected by scrolling.
+ *
+ * The panel lies on its side, so columns of the screen are its scan
+ * lines, either in the same order or, mirrored, in the opposite one.
+ * Which one it is depends on how the panel scans after swap_xy and
+ * mirror, CONFIG_TINYECG_SCROLL_MIRRORED picks it. Offsets into the
+ * scroll area are in screen columns either way.
+ *
+ * Nothing in here touches the hardware, so it can be built on the host
+ * and scroll_render() used to see what the panel would show.
+ */
+
+// The scroll area covers vsa screen columns from the first one
+void scroll_init(scroll_t *s, uint16_t first, uint16_t vsa, uint16_t lines,
+		bool mirrored)
+{
+	s->tfa = mirrored ? lines - first - vsa : first;
+	s->vsa = vsa;
+	s->bfa = lines - s->tfa - vsa;
+	s->mirrored = mirrored;
+	s->start = s->tfa;
+}
+
+// Show the scroll area from offset columns into it
+void scroll_set(scroll_t *s, uint16_t offset)
+{
+	offset %= s->vsa;
+	if (s->mirrored) offset = (s->vsa - offset) % s->vsa;
+	s->start = s->tfa + offset;
+}
+
+// Scan line of the panel that is shown at a column of the screen
+uint16_t scroll_scanline(const scroll_t *s, uint16_t column)
+{
+	if (!s->mirrored) return column;
+	return s->tfa + s->vsa + s->bfa - 1 - column;
+}
+
+// Line of the memory that is shown at the given line of the panel
+uint16_t scroll_line(const scroll_t *s, uint16_t line)
+{
+	if (line < s->tfa || line >= s->tfa + s->vsa) return line;
+	return s->tfa + (s->start - s->tfa + line - s->tfa) % s->vsa;
+}
+
+// Compose the screen from the memory, the screen is an array of
+// columns, the memory of scan lines
+void scroll_render(const scroll_t *s, const uint16_t *mem, uint16_t *screen,
+		size_t width)
+{
+	for (uint16_t col = 0; col < s->tfa + s->vsa + s->bfa; col++) {
+		memcpy(screen + col * width,
+				mem + scroll_line(s, scroll_scanline(s, col))
+					* width,
+				width * sizeof(uint16_t));
+	}
+}
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Columns of the ring of strips: the most that fit in room and are a
+// whole number of the widest strip, and so of every narrower one that
+// divides it, and of the period of what is drawn in the frame memory
+uint16_t scroll_ring(uint16_t room, uint16_t maxstrip, uint16_t period)
+{
+	unsigned lcm = maxstrip / gcd(maxstrip, period) * period;
+
+	return room - room % lcm;
+}
+
+// Column of the strip after the one at pos, back to the start when the
+// next one would not fit in size columns
+uint16_t scroll_next(uint16_t pos, uint16_t ncols, uint16_t size)
+{
+	return (pos + 2 * ncols > size) ? 0 : pos + ncols;
+}
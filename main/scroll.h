@@ -0,0 +1,33 @@
+#ifndef _SCROLL_H
+#define _SCROLL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Vertical scrolling of the panel, in its own scan lines
+typedef struct {
+	uint16_t tfa, vsa, bfa;  // top fixed, scrolling, bottom fixed lines
+	uint16_t start;  // line of the memory shown first in the scroll area
+	bool mirrored;  // screen columns run against the scan lines
+} scroll_t;
+
+void scroll_init(scroll_t *s, uint16_t first, uint16_t vsa, uint16_t lines,
+		bool mirrored);
+void scroll_set(scroll_t *s, uint16_t offset);
+uint16_t scroll_scanline(const scroll_t *s, uint16_t column);
+uint16_t scroll_line(const scroll_t *s, uint16_t line);
+void scroll_render(const scroll_t *s, const uint16_t *mem, uint16_t *screen,
+		size_t width);
+uint16_t scroll_ring(uint16_t room, uint16_t maxstrip, uint16_t period);
+uint16_t scroll_next(uint16_t pos, uint16_t ncols, uint16_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SCROLL_H */
@@ -19,6 +19,8 @@
 #define TAG "tinyecg"
 
 #define LV_TICK_PERIOD_MS 1
+#define LONG_PRESS FPS  // frames, 1 s
+#define DOUBLE_PRESS (FPS / 2)  // frames to wait for the second press
 
 static void lv_tick_task(void *arg) {
 	lv_tick_inc(LV_TICK_PERIOD_MS);
@@ -50,7 +52,8 @@ static void displayTask(void *pvParameter)
 	ESP_ERROR_CHECK(gpio_config(&(gpio_config_t) {
 				.intr_type = GPIO_INTR_NEGEDGE,
 				.mode = GPIO_MODE_INPUT,
-				.pin_bit_mask = 1ULL<<CONFIG_HWE_BUTTON_1,
+				.pin_bit_mask = 1ULL<<CONFIG_HWE_BUTTON_1
+					| 1ULL<<CONFIG_HWE_BUTTON_2,
 				.pull_down_en = GPIO_PULLDOWN_DISABLE,
 				.pull_up_en = GPIO_PULLUP_ENABLE,
 			}));
@@ -62,6 +65,8 @@ static void displayTask(void *pvParameter)
 	lv_area_t where, clear;
 	uint16_t *rawbuf = NULL;
 	uint16_t *clearbuf;
+	int held = 0;  // frames that button 2 is down
+	int pending = 0;  // frames left to wait after a short press
 	while (run_display) {
 		vTaskDelayUntil(&xLastWakeTime, xFrequency);
 		if (xSemaphoreTake(displaySemaphore,
@@ -72,13 +77,27 @@ static void displayTask(void *pvParameter)
 			if (rawbuf) {
 				lvgl_display_push(disp, &where,
 						(uint8_t *)rawbuf);
-				lvgl_display_push(disp, &clear,
+				if (clearbuf) lvgl_display_push(disp, &clear,
 						(uint8_t *)clearbuf);
 			}
+			display_scroll();
 			xSemaphoreGive(displaySemaphore);
 		}
 		int lvl = gpio_get_level(CONFIG_HWE_BUTTON_1);
 		if (!lvl) ble_stop();
+		// Short press changes the sweep speed, long press the gain,
+		// and two short presses in a row the trace mode
+		if (!gpio_get_level(CONFIG_HWE_BUTTON_2)) {
+			if (++held == LONG_PRESS) display_next_gain();
+		} else {
+			if (held && held < LONG_PRESS) {
+				if (pending) display_next_mode();
+				pending = pending ? 0 : DOUBLE_PRESS;
+			} else if (pending && !--pending) {
+				display_next_speed();
+			}
+			held = 0;
+		}
 	}
 	lvgl_display_shut(disp);
 	xSemaphoreGive(taskSemaphore);
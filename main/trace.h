@@ -0,0 +1,33 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "sampling.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Geometry of the trace on the screen, here so that the host test of
+// the scrolling mode works with the same numbers as display.c.
+
+// Frame outer sizes
+#define HEIGHT 240
+#define MFWIDTH 460
+#define SFWIDTH 70
+// Inner update window
+#define FBORDER 5  // frame line and padding before the trace
+#define FSAMPS (SPS / FPS)  // samples per frame
+#define FWIDTH (CPS / FPS)  // columns per frame at 25 mm/s
+#define MAXCOLS (2 * FWIDTH)  // at 50 mm/s
+#define FHEIGHT (HEIGHT - 2 * FBORDER)
+#define FMAX (MFWIDTH - 2 * FBORDER)
+
+// Grid of the ECG paper
+#define MM (CPS / 25)  // pixels
+#define TILE_W (5 * MM)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _TRACE_H */
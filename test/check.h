@@ -0,0 +1,38 @@
+/*
+ * What every host test shares: CHECK() prints a failed condition with
+ * its place and a message, and counts it, and the program ends with
+ * check_result(), which prints the verdict and gives the exit code.
+ */
+#ifndef _CHECK_H
+#define _CHECK_H
+
+#include <stdio.h>
+#include <time.h>
+
+static int failed = 0;  // conditions that did not hold
+
+#define CHECK(cond, ...) do { \
+		if (!(cond)) { \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			failed++; \
+		} \
+	} while (0)
+
+static inline int check_result(void)
+{
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+	return failed != 0;
+}
+
+// For the benchmarks
+static inline double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif /* _CHECK_H */
@@ -0,0 +1,31 @@
+/* Logging for the host builds of the tests. Off unless HOST_LOG is 1,
+ * arguments are still checked. */
+#ifndef _ESP_LOG_H
+#define _ESP_LOG_H
+
+#include <stdio.h>
+
+#ifndef HOST_LOG
+#define HOST_LOG 0
+#endif
+
+#define ESP_LOG_ERROR 1
+#define ESP_LOG_WARN 2
+#define ESP_LOG_INFO 3
+#define ESP_LOG_DEBUG 4
+
+#define HOST_LOG_(level, tag, ...) do { \
+		if (HOST_LOG >= (level)) { \
+			fprintf(stderr, "%s: ", tag); \
+			fprintf(stderr, __VA_ARGS__); \
+			fputc('\n', stderr); \
+		} \
+	} while (0)
+#define ESP_LOGE(tag, ...) HOST_LOG_(ESP_LOG_ERROR, tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) HOST_LOG_(ESP_LOG_WARN, tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) HOST_LOG_(ESP_LOG_INFO, tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) HOST_LOG_(ESP_LOG_DEBUG, tag, __VA_ARGS__)
+#define ESP_LOG_BUFFER_HEX_LEVEL(tag, buf, len, level) \
+	((void)(tag), (void)(buf), (void)(len), (void)(level))
+
+#endif /* _ESP_LOG_H */
@@ -0,0 +1,31 @@
+/* Just enough of FreeRTOS for the host builds of the tests. Critical
+ * sections are spinlocks, as on the dual core target. */
+#ifndef _FREERTOS_H
+#define _FREERTOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#define configTICK_RATE_HZ 1000
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+typedef struct {
+	atomic_flag flag;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { .flag = ATOMIC_FLAG_INIT }
+#define taskENTER_CRITICAL(mux) \
+	while (atomic_flag_test_and_set_explicit(&(mux)->flag, \
+				memory_order_acquire))
+#define taskEXIT_CRITICAL(mux) \
+	atomic_flag_clear_explicit(&(mux)->flag, memory_order_release)
+
+#endif /* _FREERTOS_H */
@@ -0,0 +1,6 @@
+#ifndef _TASK_H
+#define _TASK_H
+
+#include "FreeRTOS.h"
+
+#endif /* _TASK_H */
@@ -0,0 +1,37 @@
+/* Timers never fire in the host builds of the tests */
+#ifndef _TIMERS_H
+#define _TIMERS_H
+
+#include "FreeRTOS.h"
+
+typedef void *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t timer);
+
+static inline TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+		BaseType_t reload, void *id, TimerCallbackFunction_t callback)
+{
+	static int timer;
+
+	(void)name; (void)period; (void)reload; (void)id; (void)callback;
+	return &timer;
+}
+
+static inline BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait)
+{
+	(void)timer; (void)wait;
+	return pdPASS;
+}
+
+static inline BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait)
+{
+	(void)timer; (void)wait;
+	return pdPASS;
+}
+
+static inline BaseType_t xTimerIsTimerActive(TimerHandle_t timer)
+{
+	(void)timer;
+	return pdFALSE;
+}
+
+#endif /* _TIMERS_H */
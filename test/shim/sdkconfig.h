@@ -0,0 +1,33 @@
+/* Configuration for the host builds of the tests, after sdkconfig.defaults
+ * and the defaults in Kconfig.projbuild. Tests pick other variants with
+ * -D on the command line. */
+#ifndef _SDKCONFIG_H
+#define _SDKCONFIG_H
+
+#ifndef CONFIG_TINYECG_SPS
+#define CONFIG_TINYECG_SPS 150
+#endif
+#ifndef CONFIG_TINYECG_CPS
+#define CONFIG_TINYECG_CPS 150
+#endif
+#if !defined(CONFIG_TINYECG_FPS_25) && !defined(CONFIG_TINYECG_FPS_30)
+#define CONFIG_TINYECG_FPS_25 1
+#endif
+#define CONFIG_TINYECG_PLAYOUT_TARGET_MS 200
+#define CONFIG_HWE_DISPLAY_HEIGHT 536
+
+#if !defined(CONFIG_TINYECG_CRC8_NIBBLE) \
+	&& !defined(CONFIG_TINYECG_CRC8_TABLE) \
+	&& !defined(CONFIG_TINYECG_CRC8_SLICING4)
+#define CONFIG_TINYECG_CRC8_NIBBLE 1
+#endif
+
+#ifndef CONFIG_TINYECG_FILTER_NONE
+#define CONFIG_TINYECG_FILTER_HP 1
+#define CONFIG_TINYECG_FILTER_LP 1
+#ifndef CONFIG_TINYECG_FILTER_NOTCH_60
+#define CONFIG_TINYECG_FILTER_NOTCH_50 1
+#endif
+#endif
+
+#endif /* _SDKCONFIG_H */
@@ -0,0 +1,90 @@
+/*
+ * Test and benchmark of the display column kernel.
+ *
+ * column() must give the range and validity of any run of samples, as
+ * a plain loop over them does. The cost per sample is measured for the
+ * numbers of samples a column can take: SPS/CPS at 25 mm/s, half as
+ * many at 50 mm/s and twice as many at 12.5 mm/s, for the rates in
+ * Kconfig. The count is passed at run time, as display_update() does.
+ * This is the host compiler; whether the one for the target unrolls or
+ * vectorizes anything has to be seen in its output.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "column.h"
+#include "check.h"
+
+#define LEN 4096
+
+static int8_t samples[LEN + 32];
+static uint8_t valid[LEN + 32];
+
+static void fill(void)
+{
+	uint32_t seed = 1;
+
+	for (size_t i = 0; i < sizeof(samples); i++) {
+		seed = seed * 1103515245 + 12345;
+		samples[i] = seed >> 16;
+		valid[i] = ((seed >> 8) & 0x3f) != 0;
+	}
+}
+
+static void equivalence(void)
+{
+	for (int n = 1; n <= 32; n++) {
+		for (int at = 0; at + n <= LEN; at += 7) {
+			int8_t lo, hi, mn = 127, mx = -128;
+			bool ok = true;
+
+			for (int i = at; i < at + n; i++) {
+				if (samples[i] < mn) mn = samples[i];
+				if (samples[i] > mx) mx = samples[i];
+				ok = ok && valid[i];
+			}
+			bool got = column(samples + at, valid + at, n, &lo, &hi);
+			CHECK(lo == mn && hi == mx && got == ok,
+					"%d samples at %d: %d..%d %d, must be "
+					"%d..%d %d", n, at, lo, hi, got,
+					mn, mx, ok);
+			if (failed) return;
+		}
+	}
+}
+
+static void benchmark(void)
+{
+	static const int counts[] = {1, 2, 4, 8, 16};
+	const long total = 100000000;
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		int n = counts[c];
+		long reps = total / LEN;
+		volatile int sink = 0;
+		double t0 = now_s();
+
+		for (long r = 0; r < reps; r++) {
+			samples[r % LEN] = r;
+			for (int at = 0; at + n <= LEN; at += n) {
+				int8_t lo, hi;
+				sink += column(samples + at, valid + at, n,
+						&lo, &hi) + lo + hi;
+			}
+		}
+		double dt = now_s() - t0;
+		printf("%2d samples per column: %.2f ns/sample, "
+				"%.2f ns/column\n", n,
+				dt * 1e9 / (reps * (LEN - LEN % n)),
+				dt * 1e9 / (reps * (LEN / n)));
+	}
+}
+
+int main(void)
+{
+	fill();
+	equivalence();
+	benchmark();
+	return check_result();
+}
@@ -0,0 +1,142 @@
+/*
+ * Equivalence test and micro-benchmark of the CRC-8 variants.
+ *
+ * crc8.c is built once for every variant, with the function renamed
+ * after it. All of them must agree with the implementation that was
+ * in pc80b.c before, and with the plain bitwise one, for every length
+ * a frame can have and at every alignment, and also when the crc is
+ * carried along a byte at a time, as the frame parser does. Timing on
+ * the host only ranks the variants roughly, caches and flash of the
+ * target are different.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "check.h"
+
+uint8_t crc8_nibble(const uint8_t *addr, size_t len);
+uint8_t crc8_table(const uint8_t *addr, size_t len);
+uint8_t crc8_slicing4(const uint8_t *addr, size_t len);
+uint8_t crc8_update_nibble(uint8_t crc, const uint8_t *addr, size_t len);
+uint8_t crc8_update_table(uint8_t crc, const uint8_t *addr, size_t len);
+uint8_t crc8_update_slicing4(uint8_t crc, const uint8_t *addr, size_t len);
+
+static const struct {
+	const char *name;
+	uint8_t (*fn)(const uint8_t *addr, size_t len);
+	uint8_t (*update)(uint8_t crc, const uint8_t *addr, size_t len);
+} variants[] = {
+	{"nibble", crc8_nibble, crc8_update_nibble},
+	{"table", crc8_table, crc8_update_table},
+	{"slicing4", crc8_slicing4, crc8_update_slicing4},
+};
+#define VARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+// As it was in pc80b.c
+static const uint8_t dscrc2x16_table[] = {
+	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83,
+	0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
+	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
+	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74,
+};
+
+static uint8_t crc8_old(const uint8_t *addr, uint8_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--) {
+		crc = *addr++ ^ crc;  // just re-using crc as intermediate
+		crc = dscrc2x16_table[crc & 0x0f] ^
+			dscrc2x16_table[16 + ((crc >> 4) & 0x0f)];
+	}
+	return crc;
+}
+
+// X^8 + X^5 + X^4 + 1, reflected
+static uint8_t crc8_bitwise(const uint8_t *addr, size_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--) {
+		crc ^= *addr++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8c : crc >> 1;
+		}
+	}
+	return crc;
+}
+
+static uint8_t buf[4096 + 4];
+
+static void equivalence(void)
+{
+	uint32_t seed = 1;
+
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+	for (size_t v = 0; v < VARIANTS; v++) {
+		uint8_t c = variants[v].fn((const uint8_t *)"123456789", 9);
+		CHECK(c == 0xa1, "%s: check value 0x%02x", variants[v].name, c);
+	}
+	for (size_t off = 0; off < 4; off++) {
+		for (size_t len = 0; len < 256; len++) {
+			uint8_t ref = crc8_old(buf + off, len);
+			CHECK(crc8_bitwise(buf + off, len) == ref,
+					"old and bitwise differ at %zu", len);
+			for (size_t v = 0; v < VARIANTS; v++) {
+				uint8_t c = variants[v].fn(buf + off, len);
+				CHECK(c == ref, "%s: offset %zu length %zu: "
+						"0x%02x, must be 0x%02x",
+						variants[v].name, off, len,
+						c, ref);
+			}
+		}
+	}
+	for (size_t v = 0; v < VARIANTS; v++) {
+		CHECK(variants[v].fn(buf, sizeof(buf))
+				== crc8_bitwise(buf, sizeof(buf)),
+				"%s: long buffer", variants[v].name);
+		uint8_t c = 0;
+		for (size_t len = 0; len < 259; len++) {
+			CHECK(c == crc8_bitwise(buf, len), "%s: carried along, "
+					"length %zu", variants[v].name, len);
+			c = variants[v].update(c, buf + len, 1);
+		}
+	}
+}
+
+// Frames of the recorder are 59 bytes, commands are short
+static void benchmark(void)
+{
+	static const size_t lens[] = {8, 59, 259};
+
+	for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		size_t len = lens[l];
+		size_t reps = 200000000 / len / 8;
+
+		printf("%4zu bytes:", len);
+		for (size_t v = 0; v < VARIANTS; v++) {
+			volatile uint8_t sink = 0;
+			double t0 = now_s();
+
+			for (size_t r = 0; r < reps; r++) {
+				buf[0] = r;
+				sink ^= variants[v].fn(buf, len);
+			}
+			double dt = now_s() - t0;
+			printf("  %s %.2f ns/byte", variants[v].name,
+					dt * 1e9 / (reps * len));
+		}
+		printf("\n");
+	}
+}
+
+int main(void)
+{
+	equivalence();
+	benchmark();
+	return check_result();
+}
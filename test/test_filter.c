@@ -0,0 +1,156 @@
+/*
+ * Frequency response and cost of the ingestion filter chain.
+ *
+ * Sine waves of raw sample amplitude go through filter_step(), and the
+ * gain is measured once the filters have settled. It must follow the
+ * response of the Q30 coefficients in filters.h, computed here in
+ * floating point, which shows that the fixed point arithmetic does not
+ * add to it. It must also do what the filters are there for: pass the
+ * ECG band, take out the baseline wander, the mains hum and what is
+ * above 40 Hz. The cost per sample is measured on the host.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <complex.h>
+
+#include "sdkconfig.h"
+#include "sampling.h"
+#include "filter.h"
+#include "filters.h"
+#include "check.h"
+
+#define AMPLITUDE 1000  // of the raw samples, which are 12 bit
+
+// Same choice of stages as in filter.c
+static const int32_t stages[][5] = {
+#ifdef CONFIG_TINYECG_FILTER_HP
+	FILTER_HP,
+#endif
+#if defined(CONFIG_TINYECG_FILTER_NOTCH_50)
+	FILTER_NOTCH50,
+# define NOTCH 50
+#elif defined(CONFIG_TINYECG_FILTER_NOTCH_60)
+	FILTER_NOTCH60,
+# define NOTCH 60
+#endif
+#ifdef CONFIG_TINYECG_FILTER_LP
+	FILTER_LP,
+#endif
+};
+#define STAGES (sizeof(stages) / sizeof(stages[0]))
+
+static double designed_db(double f)
+{
+	double complex z = cexp(-I * 2 * M_PI * f / SPS);
+	double complex h = 1;
+
+	for (size_t i = 0; i < STAGES; i++) {
+		const int32_t *c = stages[i];
+		double complex num = c[0] + c[1] * z + c[2] * z * z;
+		double complex den = (1 << FILTER_SHIFT) + c[3] * z
+			+ c[4] * z * z;
+		h *= num / den;
+	}
+	return 20 * log10(cabs(h));
+}
+
+// Settle for 30 s or 10 periods, then measure over 4 s or 2 periods
+static double measured_db(double f)
+{
+	int period = lround(SPS / f);
+	int settle = 30 * SPS > 10 * period ? 30 * SPS : 10 * period;
+	int periods = (SPS / f < 4 * SPS) ? (4 * SPS) / period + 1 : 2;
+	int len = periods * period;
+	double in2 = 0, out2 = 0;
+
+	filter_reset();
+	for (int n = 0; n < settle + len; n++) {
+		double x = AMPLITUDE * sin(2 * M_PI * f * n / SPS);
+		int32_t y = filter_step(lround(x));
+		if (n < settle) continue;
+		in2 += x * x;
+		out2 += (double)y * y;
+	}
+	return 10 * log10(out2 / in2);
+}
+
+static void response(void)
+{
+	static const double freqs[] = {
+		0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 15, 20, 25, 30, 35, 40,
+		45, 48, 50, 52, 55, 60, 65, 70,
+	};
+
+	printf("   Hz  designed  measured (dB)\n");
+	for (size_t i = 0; i < sizeof(freqs) / sizeof(freqs[0]); i++) {
+		double f = freqs[i];
+
+		if (f >= SPS / 2.0) break;
+		double d = designed_db(f), m = measured_db(f);
+		printf("%5.2f  %8.2f  %8.2f\n", f, d, m);
+		// Rounding noise is what is left of deep stops
+		if (d > -30) {
+			CHECK(fabs(m - d) < 0.2, "%g Hz: %.2f dB, designed "
+					"%.2f dB", f, m, d);
+		} else {
+			CHECK(m < -25, "%g Hz: %.2f dB, designed %.2f dB",
+					f, m, d);
+		}
+		if (f >= 2 && f <= 30) {
+			CHECK(fabs(m) < 1, "%g Hz in the passband: %.2f dB",
+					f, m);
+		}
+	}
+#ifdef CONFIG_TINYECG_FILTER_HP
+	CHECK(measured_db(0.1) < -20, "baseline wander passes");
+	CHECK(fabs(designed_db(0.5) + 3) < 0.5, "high-pass corner");
+#endif
+#ifdef NOTCH
+	CHECK(measured_db(NOTCH) < -30, "%d Hz hum passes", NOTCH);
+#endif
+#ifdef CONFIG_TINYECG_FILTER_LP
+	CHECK(designed_db(40) < -2.5, "low-pass corner");
+#endif
+}
+
+// The first sample after reset is the steady state: an offset of the
+// input must not ring through the high-pass
+static void offset(void)
+{
+#ifdef CONFIG_TINYECG_FILTER_HP
+	int32_t worst = 0;
+
+	filter_reset();
+	for (int n = 0; n < 10 * SPS; n++) {
+		int32_t y = filter_step(1500);
+		if (abs(y) > worst) worst = abs(y);
+	}
+	CHECK(worst <= 1, "offset of the input comes out as %d", worst);
+#endif
+}
+
+static void cost(void)
+{
+	const int num = 20000000;
+	volatile int32_t sink = 0;
+	double t0 = now_s();
+
+	filter_reset();
+	for (int n = 0; n < num; n++) {
+		sink += filter_step((n * 37) % 4096 - 2048);
+	}
+	double dt = now_s() - t0;
+	printf("%zu stages, %.1f ns/sample on the host\n", STAGES,
+			dt * 1e9 / num);
+}
+
+int main(void)
+{
+	response();
+	offset();
+	cost();
+	return check_result();
+}
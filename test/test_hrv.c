@@ -0,0 +1,156 @@
+/*
+ * Test of the streaming HRV statistics against a naive reference.
+ *
+ * Long traces of RR intervals, with artefacts and breaks in them, go
+ * into hrv_add(). After every beat the published statistics must be
+ * what the reference gets by going over the whole window: the longest
+ * run of the latest accepted intervals that fits in five minutes and
+ * in the ring, with successive differences only between intervals
+ * that followed each other.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "data.h"
+#include "hrv.h"
+#include "check.h"
+
+#define WINDOW_MS (5 * 60 * 1000)
+#define RING 1024
+#define BEATS 100000
+
+static data_stash_t got;
+
+void report_hrv(data_stash_t *ds)
+{
+	got = *ds;
+}
+
+static uint16_t rr[BEATS];
+static bool paired[BEATS];
+static int n_rr;
+static bool chained;
+
+static void ref_add(uint16_t rri)
+{
+	if (rri < 250 || rri > 2500) {
+		chained = false;
+		return;
+	}
+	paired[n_rr] = chained && n_rr > 0;
+	rr[n_rr++] = rri;
+	chained = true;
+}
+
+static void ref_check(int beat)
+{
+	int first = n_rr;
+	uint32_t sum = 0;
+
+	while (first > 0 && n_rr - first < RING
+			&& sum + rr[first - 1] <= WINDOW_MS) {
+		sum += rr[--first];
+	}
+	int n = n_rr - first;
+	double mean = n ? (double)sum / n : 0, var = 0, dsum2 = 0;
+	uint16_t mn = 0xffff, mx = 0;
+	uint32_t pairs = 0, nn50 = 0;
+
+	for (int i = first; i < n_rr; i++) {
+		var += (rr[i] - mean) * (rr[i] - mean);
+		if (rr[i] < mn) mn = rr[i];
+		if (rr[i] > mx) mx = rr[i];
+		if (i > first && paired[i]) {
+			int d = rr[i] - rr[i - 1];
+			dsum2 += d * d;
+			pairs++;
+			if (abs(d) > 50) nn50++;
+		}
+	}
+	CHECK(got.hrv_beats == n, "beat %d: %u beats, must be %d",
+			beat, got.hrv_beats, n);
+	if (!n) return;
+	CHECK(got.hrv_mean_hr == lround(60000.0 * n / sum),
+			"beat %d: mean hr %u", beat, got.hrv_mean_hr);
+	CHECK(got.hrv_min_rr == mn && got.hrv_max_rr == mx,
+			"beat %d: min %u max %u, must be %u %u", beat,
+			got.hrv_min_rr, got.hrv_max_rr, mn, mx);
+	if (n > 1) {
+		double sdnn = sqrt(var / (n - 1));
+		CHECK(fabs(got.hrv_sdnn - sdnn) < 1, "beat %d: sdnn %u, "
+				"must be %.2f", beat, got.hrv_sdnn, sdnn);
+	}
+	if (pairs) {
+		double rmssd = sqrt(dsum2 / pairs);
+		CHECK(fabs(got.hrv_rmssd - rmssd) < 1, "beat %d: rmssd %u, "
+				"must be %.2f", beat, got.hrv_rmssd, rmssd);
+		CHECK(got.hrv_pnn50 == nn50 * 1000 / pairs,
+				"beat %d: pnn50 %u, must be %u", beat,
+				got.hrv_pnn50, nn50 * 1000 / pairs);
+	} else {
+		CHECK(got.hrv_rmssd == 0 && got.hrv_pnn50 == 0,
+				"beat %d: rmssd without pairs", beat);
+	}
+}
+
+static uint32_t seed = 1;
+
+static double gauss(void)
+{
+	double u = 0;
+
+	for (int i = 0; i < 12; i++) {
+		seed = seed * 1103515245 + 12345;
+		u += (seed >> 8) / (double)(1 << 24);
+	}
+	return u - 6;
+}
+
+// A trace around the given mean, drifting slowly, with a fraction of
+// artefacts and breaks in it, in percent
+static void trace(const char *what, double mean, double sd,
+		int artefacts, int breaks)
+{
+	int failed0 = failed;
+
+	hrv_reset();
+	n_rr = 0;
+	chained = false;
+	for (int b = 0; b < BEATS && failed == failed0; b++) {
+		double m = mean * (1 + 0.1 * sin(b / 500.0));
+		int v = lround(m + sd * gauss());
+		int r = abs((int)(seed >> 4)) % 100;
+
+		if (r < artefacts) v = (r & 1) ? 100 : 3500;
+		if (r >= 50 && r < 50 + breaks) {
+			hrv_break();
+			chained = false;
+		}
+		hrv_add(v);
+		ref_add(v);
+		ref_check(b);
+	}
+	printf("%-12s %d beats, window of %u, mean %u bpm, sdnn %u ms, "
+			"rmssd %u ms, pnn50 %.1f%%\n", what, BEATS,
+			got.hrv_beats, got.hrv_mean_hr, got.hrv_sdnn,
+			got.hrv_rmssd, got.hrv_pnn50 / 10.0);
+}
+
+int main(void)
+{
+	// An artefact between two intervals ends the chain
+	hrv_reset();
+	hrv_add(800);
+	hrv_add(3000);
+	hrv_add(900);
+	CHECK(got.hrv_beats == 2 && got.hrv_rmssd == 0 && got.hrv_pnn50 == 0,
+			"difference taken across an artefact");
+
+	trace("steady", 800, 40, 0, 0);
+	trace("artefacts", 900, 80, 5, 0);
+	trace("breaks", 700, 60, 0, 3);
+	trace("fast", 272, 10, 1, 1);  // the ring is full before 5 minutes
+	trace("slow", 1800, 150, 2, 0);
+	return check_result();
+}
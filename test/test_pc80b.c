@@ -0,0 +1,176 @@
+/*
+ * Fuzz test and throughput benchmark of the PC-80B frame parser.
+ *
+ * pc80b.c is built in, with the rest of the ingestion path behind it,
+ * so that the parser's statistics are at hand. The stream is what the
+ * recorder sends in continuous mode: data frames of 25 samples with an
+ * occasional heartbeat frame, made up here rather than captured. It
+ * is fed in pieces of random size, as notifications come, clean and
+ * then with a fraction of the bytes replaced by random ones, or with
+ * bursts of garbage thrown in between the frames.
+ *
+ * A frame that was not touched by the corruption must be recovered,
+ * even when it follows a damaged one in the same notification.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../main/pc80b.c"
+#include "check.h"
+
+#define FRAMES 200000
+#define MAX_STREAM (FRAMES * 64)
+
+bool ble_write(uint16_t handle, uint8_t *data, size_t datalen)
+{
+	(void)handle; (void)data; (void)datalen;
+	return true;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static uint8_t stream[MAX_STREAM];
+static size_t starts[FRAMES + 1];  // offsets of the frames in stream
+static uint8_t damaged[FRAMES];
+
+static size_t put_frame(uint8_t *to, uint8_t opcode, const uint8_t *payload,
+		uint8_t len)
+{
+	to[0] = 0xa5;
+	to[1] = opcode;
+	to[2] = len;
+	memcpy(to + 3, payload, len);
+	to[3 + len] = crc8(to, 3 + len);
+	return len + 4;
+}
+
+// Continuous mode data frames at 150 SPS, a heartbeat every 90 of them
+static size_t make_stream(void)
+{
+	size_t len = 0;
+	uint32_t t = 0;
+
+	for (int f = 0; f < FRAMES; f++) {
+		starts[f] = len;
+		if (f % 90 == 89) {
+			len += put_frame(stream + len, 0xff,
+					(uint8_t []){2}, 1);
+			continue;
+		}
+		uint8_t p[55] = {(uint8_t)f};
+		for (int i = 0; i < SAMPS; i++, t++) {
+			double ph = (t % 120) / 120.0;
+			int v = 2048 + 200 * sin(2 * M_PI * ph)
+				+ ((ph > 0.3 && ph < 0.33) ? 800 : 0);
+			p[1 + 2 * i] = v & 0xff;
+			p[2 + 2 * i] = v >> 8;
+		}
+		p[51] = 75;  // hr
+		len += put_frame(stream + len, 0xaa, p, 55);
+	}
+	starts[FRAMES] = len;
+	return len;
+}
+
+// Replace bytes at random, at the rate of one in every
+static void corrupt(uint8_t *s, size_t len, uint32_t every)
+{
+	int f = 0;
+
+	memset(damaged, 0, sizeof(damaged));
+	for (size_t i = 0; i < len; i++) {
+		while (starts[f + 1] <= i) f++;
+		if (rnd() % every) continue;
+		uint8_t b = rnd();
+		if (b == s[i]) continue;
+		s[i] = b;
+		damaged[f] = 1;
+	}
+}
+
+// Feed in notification sized pieces, returns bytes per second
+static double feed(const uint8_t *s, size_t len)
+{
+	uint8_t piece[256];
+	double t0 = now_s();
+
+	start();
+	for (size_t i = 0; i < len; ) {
+		size_t n = 20 + rnd() % 225;
+		if (n > len - i) n = len - i;
+		memcpy(piece, s + i, n);  // receive() takes a mutable buffer
+		receive(piece, n);
+		i += n;
+	}
+	double dt = now_s() - t0;
+	return len / dt;
+}
+
+static void run(const char *what, const uint8_t *s, size_t len,
+		uint32_t expect, double min_ratio)
+{
+	double bps = feed(s, len);
+	double ratio = (double)pstat.frames / expect;
+
+	printf("%-16s %6lu/%u frames (%.2f%% of intact), %lu bad crc, "
+			"%lu bad opcode, %lu skipped, %.1f MB/s\n", what,
+			(unsigned long)pstat.frames, expect, 100 * ratio,
+			(unsigned long)pstat.badcrc,
+			(unsigned long)pstat.badop,
+			(unsigned long)pstat.skipped, bps / 1e6);
+	CHECK(ratio >= min_ratio, "%s: recovered %.2f%% of intact frames",
+			what, 100 * ratio);
+}
+
+static uint8_t work[MAX_STREAM + FRAMES * 16];
+
+int main(void)
+{
+	size_t len = make_stream();
+
+	data_init();
+	init();
+	run("clean", stream, len, FRAMES, 1.0);
+	CHECK(pstat.skipped == 0, "bytes skipped in a clean stream");
+
+	static const uint32_t rates[] = {100000, 10000, 1000, 100};
+	for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		char what[32];
+		uint32_t intact = 0;
+
+		memcpy(work, stream, len);
+		corrupt(work, len, rates[r]);
+		for (int f = 0; f < FRAMES; f++) intact += !damaged[f];
+		snprintf(what, sizeof(what), "1/%u corrupt", rates[r]);
+		// A damaged length byte may hide a frame or two behind it
+		// until the CRC fails, but they are parsed after that
+		run(what, work, len, intact, rates[r] >= 1000 ? 0.9995 : 0.99);
+	}
+
+	// Bursts of garbage between frames, sometimes with sync bytes
+	size_t wlen = 0;
+	for (int f = 0; f < FRAMES; f++) {
+		if (rnd() % 20 == 0) {
+			size_t n = 1 + rnd() % 16;
+			for (size_t i = 0; i < n; i++) {
+				work[wlen++] = (rnd() % 4) ? rnd() : 0xa5;
+			}
+		}
+		memcpy(work + wlen, stream + starts[f],
+				starts[f + 1] - starts[f]);
+		wlen += starts[f + 1] - starts[f];
+	}
+	run("garbage bursts", work, wlen, FRAMES, 0.9995);
+	stop();
+
+	return check_result();
+}
@@ -0,0 +1,220 @@
+/*
+ * Accuracy test and benchmark of the R peak detector.
+ *
+ * There are no recordings in the tree, so the traces are synthesized
+ * with the same wave model as mkbeats.py, at known R peak times, and
+ * spoiled with what a real lead picks up: baseline wander, mains hum,
+ * noise, and a long lead-off. A detected beat matches a true one when
+ * its reported time is within 100 ms of it. Sensitivity and positive
+ * predictivity must be high, detection must come less than a beat
+ * late, and no interval across the lead-off may reach HRV.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sampling.h"
+#include "data.h"
+#include "hrv.h"
+#include "qrs.h"
+#include "check.h"
+
+#define MAX_BEATS 4000
+#define TOL (SPS / 10)  // 100 ms
+#define SETTLE (3 * SPS)  // the detector learns the levels meanwhile
+
+static uint32_t fed;  // samples given to the detector
+static uint32_t det[MAX_BEATS], det_at[MAX_BEATS];
+static int n_det;
+static uint8_t last_hr;
+static uint16_t rr_ms[MAX_BEATS];
+static int n_rr;
+
+void report_qrs(data_stash_t *ds)
+{
+	if (!ds->qrs_beats || n_det == MAX_BEATS) return;
+	det[n_det] = ds->qrs_time;
+	det_at[n_det++] = fed;
+	last_hr = ds->qrs_hr;
+}
+
+void hrv_add(uint16_t rri)
+{
+	if (n_rr < MAX_BEATS) rr_ms[n_rr++] = rri;
+}
+
+void hrv_break(void)
+{
+}
+
+static uint32_t seed = 1;
+
+static double uniform(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) / (double)(1 << 24);
+}
+
+static double gauss(void)
+{
+	double u = 0;
+
+	for (int i = 0; i < 12; i++) u += uniform();
+	return u - 6;
+}
+
+// Same waves as mkbeats.py, around the R peak at 0, times in s
+static double wave(double t, double rr)
+{
+	double scale = sqrt(rr);
+	double t_width = 0.05 * scale;
+	double t_end = -0.04 + 0.40 * scale;
+	double k = fmin(1, (rr - t_end) / 0.25);
+	const double w[5][3] = {
+		{-0.17 * k, 0.025 * k, 8},
+		{-0.025, 0.010, -10},
+		{0.0, 0.012, 115},
+		{0.030, 0.010, -22},
+		{t_end - 2.5 * t_width, t_width, 48},
+	};
+	double v = 0;
+
+	for (int i = 0; i < 5; i++) {
+		double x = (t - w[i][0]) / w[i][1];
+		v += w[i][2] * exp(-x * x / 2);
+	}
+	return v;
+}
+
+typedef struct {
+	const char *name;
+	double seconds;
+	double rr_min, rr_max;  // s, the rate sweeps between the two
+	double jitter;  // s, random on every beat
+	double wander, hum, noise;  // amplitudes, in sample units
+	double off_at, off_len;  // lead-off, s
+	double min_se, min_ppv;
+} trace_t;
+
+static uint32_t truth[MAX_BEATS];  // R peaks, in samples
+static int n_truth;
+static int8_t sig[20 * 60 * SPS];
+
+static size_t synthesize(const trace_t *tr)
+{
+	size_t len = tr->seconds * SPS;
+	double t = 0.5;
+	int b = 0;
+	double rr[MAX_BEATS], at[MAX_BEATS];
+
+	while (t < tr->seconds && b < MAX_BEATS) {
+		double ph = (1 - cos(2 * M_PI * t / tr->seconds)) / 2;
+		double r = tr->rr_max + (tr->rr_min - tr->rr_max) * ph
+			+ tr->jitter * (2 * uniform() - 1);
+		rr[b] = r;
+		at[b++] = t;
+		t += r;
+	}
+	n_truth = 0;
+	for (int i = 0; i < b; i++) {
+		if (at[i] >= tr->off_at && at[i] < tr->off_at + tr->off_len)
+			continue;
+		truth[n_truth++] = lround(at[i] * SPS);
+	}
+	for (size_t n = 0, i = 0; n < len; n++) {
+		double s = (double)n / SPS;
+		double v = 0;
+
+		if (s >= tr->off_at && s < tr->off_at + tr->off_len) {
+			sig[n] = 0;
+			continue;
+		}
+		while (i + 1 < (size_t)b && at[i + 1] <= s) i++;
+		v += wave(s - at[i], rr[i]);
+		if (i + 1 < (size_t)b) v += wave(s - at[i + 1], rr[i + 1]);
+		v += tr->wander * sin(2 * M_PI * 0.3 * s);
+		v += tr->hum * sin(2 * M_PI * 50 * s);
+		v += tr->noise * gauss();
+		sig[n] = (v < -120) ? -120 : (v > 120) ? 120 : lround(v);
+	}
+	return len;
+}
+
+static void accuracy(const trace_t *tr)
+{
+	size_t len = synthesize(tr);
+	int tp = 0, lat_max = 0;
+
+	qrs_reset();
+	n_det = n_rr = 0;
+	for (fed = 0; fed < len; ) {
+		qrs_feed(sig + fed, 1);
+		fed++;
+	}
+	int expect = 0, found = 0;
+	for (int i = 0, j = 0; i < n_truth; i++) {
+		if (truth[i] < SETTLE) continue;
+		expect++;
+		while (j < n_det && det[j] + TOL < truth[i]) j++;
+		if (j < n_det && det[j] <= truth[i] + TOL) {
+			int lat = det_at[j] - truth[i];
+			if (lat > lat_max) lat_max = lat;
+			tp++;
+			j++;
+		}
+	}
+	for (int j = 0; j < n_det; j++) found += (det[j] + TOL >= SETTLE);
+	// The first beat after the lead-off has no interval and is not
+	// reported
+	expect -= (tr->off_len > 0);
+	double se = (double)tp / expect, ppv = (double)tp / found;
+	printf("%-10s %4d beats, %4d detected, Se %.2f%%, +P %.2f%%, "
+			"latency up to %d ms, HR %u\n", tr->name, expect,
+			found, 100 * se, 100 * ppv, lat_max * 1000 / SPS,
+			last_hr);
+	CHECK(se >= tr->min_se, "%s: sensitivity %.4f", tr->name, se);
+	CHECK(ppv >= tr->min_ppv, "%s: predictivity %.4f", tr->name, ppv);
+	CHECK(lat_max < tr->rr_min * SPS, "%s: detected %d ms late",
+			tr->name, lat_max * 1000 / SPS);
+	for (int i = 0; i < n_rr; i++) {
+		CHECK(rr_ms[i] <= (tr->rr_max + tr->jitter) * 1000 + 100,
+				"%s: interval of %u ms", tr->name, rr_ms[i]);
+	}
+}
+
+static const trace_t traces[] = {
+	{"steady", 600, 0.8, 0.8, 0.03, 5, 0, 1, 0, 0, 0.995, 0.995},
+	{"exercise", 900, 0.35, 1.0, 0.02, 10, 0, 2, 0, 0, 0.99, 0.99},
+	{"irregular", 600, 0.8, 0.8, 0.35, 5, 0, 1, 0, 0, 0.99, 0.99},
+	{"noisy", 600, 0.8, 0.8, 0.03, 30, 10, 5, 0, 0, 0.97, 0.97},
+	// Gap such that samples to ms would wrap to a plausible interval
+	{"lead-off", 900, 0.8, 0.8, 0.03, 5, 0, 1, 300, 66.2, 0.99, 0.99},
+};
+
+// Frames of 25 samples, as they come from the recorder
+static void benchmark(void)
+{
+	size_t len = synthesize(&traces[3]);
+	int rounds = 20;
+	double t0 = now_s();
+
+	qrs_reset();
+	for (int r = 0; r < rounds; r++) {
+		for (size_t i = 0; i + 25 <= len; i += 25) {
+			qrs_feed(sig + i, 25);
+		}
+	}
+	double dt = now_s() - t0;
+	printf("%.1f ns/sample on the host\n",
+			dt * 1e9 / (rounds * (len - len % 25)));
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(traces) / sizeof(traces[0]); i++) {
+		accuracy(&traces[i]);
+	}
+	benchmark();
+	return check_result();
+}
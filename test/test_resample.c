@@ -0,0 +1,145 @@
+/*
+ * Passband, aliasing and throughput of the polyphase resampler.
+ *
+ * For every ratio, sines of raw sample amplitude are resampled to SPS,
+ * and the output is fitted with a sine of the same frequency. In the
+ * passband its gain must be flat, and what the fit leaves over
+ * (aliases, images, the phase error of the shared phases, rounding)
+ * must be small. When the phases do not all fit in the table, the
+ * nearest one is up to 1/64 of a sample off, and this jitter is what
+ * limits the spurious level. Tones that the output rate cannot carry
+ * must be taken out, instead of folding back into the band.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <math.h>
+
+#include "sampling.h"
+#include "../main/resample.c"
+#include "check.h"
+
+#define AMPLITUDE 1000
+#define SECONDS 8
+
+static int32_t out[SECONDS * SPS + RESAMPLE_MAX_UP];
+
+static size_t run(unsigned from, double f)
+{
+	size_t n = 0;
+
+	resample_init(from, SPS);
+	for (unsigned i = 0; i < SECONDS * from; i++) {
+		int32_t x = lround(AMPLITUDE * sin(2 * M_PI * f * i / from));
+		int32_t o[RESAMPLE_MAX_UP];
+		size_t got = resample(x, o);
+		for (size_t j = 0; j < got && n < sizeof(out) / sizeof(out[0]);
+				j++) {
+			out[n++] = o[j];
+		}
+	}
+	return n;
+}
+
+// Gain of the tone at f, and power of the rest relative to it, in dB,
+// over the output after the filter has filled
+static void fit(size_t n, double f, double *gain, double *rest)
+{
+	size_t skip = SPS;  // way more than the latency
+	double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0, yy = 0;
+
+	for (size_t i = skip; i < n; i++) {
+		double s = sin(2 * M_PI * f * i / SPS);
+		double c = cos(2 * M_PI * f * i / SPS);
+		ss += s * s;
+		sc += s * c;
+		cc += c * c;
+		ys += out[i] * s;
+		yc += out[i] * c;
+		yy += (double)out[i] * out[i];
+	}
+	double det = ss * cc - sc * sc;
+	double a = (ys * cc - yc * sc) / det, b = (yc * ss - ys * sc) / det;
+	double sig = a * ys + b * yc;  // power explained by the fit
+	double amp = sqrt(a * a + b * b);
+
+	*gain = 20 * log10(amp / AMPLITUDE);
+	*rest = 10 * log10((yy - sig > 1e-9 ? yy - sig : 1e-9) / sig);
+}
+
+static void ratio(unsigned from)
+{
+	double lower = ((from < SPS) ? from : SPS) / 2.0;  // Nyquist
+	double gmin = 1e9, gmax = -1e9, worst = -1e9, limit;
+
+	for (double f = 1; f <= 0.6 * lower; f += lower / 20) {
+		double gain, rest;
+		fit(run(from, f), f, &gain, &rest);
+		if (gain < gmin) gmin = gain;
+		if (gain > gmax) gmax = gain;
+		if (rest > worst) worst = rest;
+	}
+	limit = (phases == up) ? -55 : -35;
+	printf("%4u -> %u SPS: %2u of %2u phases, passband to %4.1f Hz "
+			"ripple %.3f dB, spurious %.1f dB", from, SPS, phases,
+			up, 0.6 * lower, gmax - gmin, worst);
+	CHECK(gmax - gmin < 0.1 && fabs(gmax) < 0.1,
+			"%u SPS: passband %.3f to %.3f dB", from, gmin, gmax);
+	CHECK(worst < limit, "%u SPS: spurious %.1f dB", from, worst);
+
+	// What the output cannot carry, in the stop band of the filter
+	if (from > SPS) {
+		double stop = -1e9;
+		for (double f = SPS * 0.6; f < from / 2.0; f += from / 40.0) {
+			size_t n = run(from, f);
+			double p = 0;
+			for (size_t i = SPS; i < n; i++) {
+				p += (double)out[i] * out[i];
+			}
+			p = 10 * log10(p / (n - SPS)
+					/ (AMPLITUDE * AMPLITUDE / 2.0) + 1e-12);
+			if (p > stop) stop = p;
+		}
+		printf(", aliases %.1f dB", stop);
+		CHECK(stop < -55, "%u SPS: aliases at %.1f dB", from, stop);
+	}
+	printf("\n");
+}
+
+static void throughput(unsigned from)
+{
+	const unsigned num = 2000000;
+	volatile int32_t sink = 0;
+	size_t outs = 0;
+
+	resample_init(from, SPS);
+	double t0 = now_s();
+	for (unsigned i = 0; i < num; i++) {
+		int32_t o[RESAMPLE_MAX_UP];
+		size_t got = resample((i * 37) % 4096 - 2048, o);
+		if (got) sink += o[0];
+		outs += got;
+	}
+	double dt = now_s() - t0;
+	printf("%4u -> %u SPS: %.1f ns/input, %.1f ns/output\n", from, SPS,
+			dt * 1e9 / num, dt * 1e9 / outs);
+}
+
+static const unsigned rates[] = {100, 128, 130, 200, 250, 360, 500, 1000};
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		ratio(rates[i]);
+	}
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		throughput(rates[i]);
+	}
+	// Same rate passes through, too high a factor is refused
+	resample_init(SPS, SPS);
+	CHECK(!resample_active(), "resampling to the same rate");
+	resample_init(SPS / 10, SPS);
+	CHECK(!resample_active(), "upsampling by 10 accepted");
+	return check_result();
+}
@@ -0,0 +1,155 @@
+/*
+ * Stress test of the single producer / single consumer sample ring.
+ *
+ * data.c is built in, so that the consumer thread can take samples out
+ * of the ring the same way playout() does, without the latency control
+ * that drops and duplicates samples. The producer thread goes through
+ * data_reserve() and data_commit(), in chunks of random size, writing
+ * a running count. The consumer checks that every sample comes in
+ * order: a sample read before it was written, or overwritten before
+ * it was read, is BUFSIZE off, and that is not a multiple of 256.
+ * Barriers can only be caught missing on a weakly ordered CPU, or when
+ * the compiler moves the accesses.
+ *
+ * Accounting of overruns and underruns is checked separately, through
+ * the public interface only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../main/data.c"
+#include "check.h"
+
+#ifndef TOTAL
+#define TOTAL 20000000u  // samples
+#endif
+#define CHUNK 64
+
+static uint32_t rnd(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void *producer(void *arg)
+{
+	uint32_t seed = 12345, count = 0;
+	data_stash_t ds = {};
+
+	(void)arg;
+	while (count < TOTAL) {
+		data_span_t span;
+		size_t want = 1 + rnd(&seed) % CHUNK;
+
+		if (want > TOTAL - count) want = TOTAL - count;
+		size_t num = data_reserve(want, &span);
+		for (size_t i = 0; i < num; i++) {
+			*data_span_at(&span, i) = (int8_t)(count + i);
+		}
+		data_commit(&ds, num);
+		count += num;
+		if (!num) usleep(1);  // let the other side run on one CPU
+	}
+	return NULL;
+}
+
+static uint32_t mismatches = 0;
+
+static void *consumer(void *arg)
+{
+	uint32_t seed = 54321, count = 0;
+	int8_t buf[CHUNK];
+	uint8_t ok[CHUNK];
+
+	(void)arg;
+	while (count < TOTAL) {
+		uint16_t r = atomic_load_explicit(&rdp, memory_order_relaxed);
+		uint16_t w = atomic_load_explicit(&wrp, memory_order_acquire);
+		size_t num = 1 + rnd(&seed) % CHUNK;
+		size_t amount = ring_amount(w, r);
+
+		if (num > amount) num = amount;
+		if (!num) {
+			usleep(1);
+			continue;
+		}
+		ring_read(&r, buf, ok, num);
+		atomic_store_explicit(&rdp, r, memory_order_release);
+		for (size_t i = 0; i < num; i++, count++) {
+			if (buf[i] != (int8_t)count || ok[i] != 1) {
+				if (!mismatches++) {
+					printf("FAIL: sample %u is %d, valid %u\n",
+						count, buf[i], ok[i]);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+static void stress(void)
+{
+	pthread_t p, c;
+	double t0 = now_s();
+
+	pthread_create(&c, NULL, consumer, NULL);
+	pthread_create(&p, NULL, producer, NULL);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+	double dt = now_s() - t0;
+	printf("ring: %u samples in %.2f s, %.1f Msamples/s, "
+			"%u refused for lack of space\n", TOTAL, dt,
+			TOTAL / dt / 1e6, (unsigned)atomic_load(&overruns));
+	CHECK(!mismatches, "%u samples out of order", mismatches);
+}
+
+// Overruns are the samples that did not fit. Underruns are only
+// counted once playout has started and runs out of data.
+static void accounting(void)
+{
+	data_stash_t ds = {}, st;
+	data_span_t span;
+	int8_t buf[SPS / FPS];
+	uint8_t ok[SPS / FPS];
+	uint32_t over0 = atomic_load(&overruns);
+
+	CHECK(data_reserve(BUFSIZE + 10, &span) == BUFSIZE,
+			"reserve of more than fits");
+	CHECK(atomic_load(&overruns) - over0 == 10, "overruns %u",
+			(unsigned)(atomic_load(&overruns) - over0));
+	data_commit(&ds, 0);
+
+	// Empty ring, not playing: made up, but not an underrun
+	atomic_store(&wrp, 0);
+	atomic_store(&rdp, 0);
+	atomic_store(&underruns, 0);
+	playing = false;
+	for (int i = 0; i < 10; i++) get_stash(&st, SPS / FPS, buf, ok);
+	CHECK(st.underrun && st.underruns == 0,
+			"idle counted as underrun: %u", st.underruns);
+
+	// Fill to the target, play it out, then run dry in the middle
+	// of a frame
+	size_t num = data_reserve(PLAYOUT_TARGET + SPS / FPS / 2, &span);
+	data_commit(&ds, num);
+	for (int i = 0; i < 100 && !st.underruns; i++) {
+		get_stash(&st, SPS / FPS, buf, ok);
+	}
+	CHECK(st.underruns == SPS / FPS - num % (SPS / FPS),
+			"dry ring underruns %u", st.underruns);
+	uint32_t under = st.underruns;
+	get_stash(&st, SPS / FPS, buf, ok);
+	CHECK(st.underruns == under, "refilling counted as underrun");
+}
+
+int main(void)
+{
+	data_init();
+	stress();
+	accounting();
+	return check_result();
+}
@@ -0,0 +1,141 @@
+/*
+ * Test of the scrolling mode of the trace on the panel model.
+ *
+ * The scroll area is sized, strips are written into the frame memory
+ * and the panel is scrolled with the same calls and the same geometry
+ * as display_init() and display_update() use, and scroll_render()
+ * shows what the panel would. Every scan line of the memory holds the
+ * number of the trace column written to it, so the screen must show
+ * the latest columns in order, the newest at the right edge of the
+ * scroll area, while the fixed areas never move. Going back to the
+ * sweep must show the memory as it is. Both ways the panel may map
+ * screen columns to its scan lines are tried.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "trace.h"
+#include "scroll.h"
+#include "check.h"
+
+#define LINES CONFIG_HWE_DISPLAY_HEIGHT
+#define FIXED 0xffff  // what the fixed areas hold
+
+static uint16_t mem[LINES], screen[LINES];
+static const int speeds[] = {FWIDTH / 2, FWIDTH, 2 * FWIDTH};
+#define SPEEDS (sizeof(speeds) / sizeof(speeds[0]))
+
+static void check_fixed(const scroll_t *s, const char *what)
+{
+	for (uint16_t c = 0; c < LINES; c++) {
+		if (c >= FBORDER && c < FBORDER + s->vsa) continue;
+		CHECK(screen[c] == FIXED, "%s: fixed column %u moved", what, c);
+	}
+}
+
+static void scrolling(int ncols, bool mirrored)
+{
+	scroll_t s;
+	uint32_t pos = 0;
+	uint16_t col = 0;  // next column of the trace
+
+	scroll_init(&s, FBORDER, scroll_ring(FMAX, MAXCOLS, TILE_W), LINES,
+			mirrored);
+	uint16_t vsa = s.vsa;
+	for (uint16_t l = 0; l < LINES; l++) mem[l] = FIXED;
+	for (uint16_t c = FBORDER; c < FBORDER + vsa; c++) {
+		mem[scroll_scanline(&s, c)] = 0;
+	}
+	for (int frame = 0; frame < 3 * vsa / ncols; frame++) {
+		// The strip replaces the oldest one, then the panel scrolls
+		for (int x = 0; x < ncols; x++) {
+			mem[scroll_scanline(&s, FBORDER + pos + x)] = ++col;
+		}
+		pos = scroll_next(pos, ncols, vsa);
+		scroll_set(&s, pos);
+		scroll_render(&s, mem, screen, 1);
+
+		check_fixed(&s, "scrolling");
+		uint16_t shown = (col < vsa) ? col : vsa;
+		for (uint16_t i = 0; i < vsa; i++) {
+			uint16_t want = (i < vsa - shown) ? 0
+				: col - (vsa - 1 - i);
+			CHECK(screen[FBORDER + i] == want, "%d columns per "
+					"frame%s, frame %d: column %u shows %u, "
+					"must be %u", ncols,
+					mirrored ? ", mirrored" : "", frame,
+					FBORDER + i, screen[FBORDER + i],
+					want);
+		}
+		if (failed) return;
+	}
+
+	// Back to the sweep, the panel shows its memory unscrolled
+	scroll_set(&s, 0);
+	scroll_render(&s, mem, screen, 1);
+	for (uint16_t c = 0; c < LINES; c++) {
+		CHECK(screen[c] == mem[scroll_scanline(&s, c)],
+				"sweep is scrolled at column %u", c);
+	}
+	printf("%d columns per frame%s: %u columns scrolled through %u "
+			"lines %u to %u\n", ncols, mirrored ? ", mirrored" : "",
+			col, vsa, s.tfa, s.tfa + vsa - 1);
+}
+
+// Strips and the grid continue where the ring wraps around, and the
+// sweep's strips stay in the window
+static void ring(void)
+{
+	uint16_t vsa = scroll_ring(FMAX, MAXCOLS, TILE_W);
+
+	CHECK(vsa <= FMAX && vsa > 0, "ring of %u columns", vsa);
+	CHECK(vsa % TILE_W == 0, "ring of %u breaks the grid of %u",
+			vsa, TILE_W);
+	for (size_t i = 0; i < SPEEDS; i++) {
+		int ncols = speeds[i];
+		uint32_t pos = 0, strips = 0;
+
+		CHECK(vsa % ncols == 0, "ring of %u breaks strips of %d",
+				vsa, ncols);
+		do {
+			CHECK(pos + ncols <= FMAX, "sweep strip at %u of %d",
+					pos, ncols);
+			pos = scroll_next(pos, ncols, FMAX);
+			strips++;
+		} while (pos && strips < FMAX);
+		CHECK(strips == (uint32_t)(FMAX / ncols), "sweep of %u strips of %d",
+				strips, ncols);
+	}
+	printf("Ring of %u of %u columns, grid period %u\n", vsa, FMAX,
+			TILE_W);
+}
+
+int main(void)
+{
+	scroll_t s;
+
+	// Lines are only moved inside the scroll area, and wrap in it
+	uint16_t vsa = scroll_ring(FMAX, MAXCOLS, TILE_W);
+	scroll_init(&s, FBORDER, vsa, LINES, false);
+	CHECK(s.bfa == LINES - FBORDER - vsa, "bottom area of %u", s.bfa);
+	scroll_set(&s, vsa + 3);
+	CHECK(scroll_line(&s, FBORDER) == FBORDER + 3, "offset does not wrap");
+	CHECK(scroll_line(&s, FBORDER + vsa - 3) == FBORDER,
+			"scroll area does not wrap");
+	CHECK(scroll_line(&s, FBORDER - 1) == FBORDER - 1
+			&& scroll_line(&s, FBORDER + vsa) == FBORDER + vsa,
+			"fixed lines move");
+	scroll_init(&s, FBORDER, vsa, LINES, true);
+	CHECK(s.bfa == FBORDER && s.tfa == LINES - FBORDER - vsa,
+			"mirrored: areas of %u and %u", s.tfa, s.bfa);
+
+	ring();
+	// All the speeds: 12.5, 25 and 50 mm/s, both ways of scanning
+	for (size_t i = 0; i < SPEEDS; i++) {
+		scrolling(speeds[i], false);
+		scrolling(speeds[i], true);
+	}
+	return check_result();
+}